@@ -8,39 +8,11 @@
 #include <string>
 #include <chrono>
 
-template <class chrono_time_type>
-auto ex_sleep(std::uint64_t time)
-{
-	using namespace std::chrono;
-	auto timepoint = system_clock::now();
-	while (duration_cast<chrono_time_type>(system_clock::now() - timepoint).count() < time);
-}
-
-class ip_sock {
-	int sock;
-public:
-	ip_sock() { this->sock = socket(AF_INET, SOCK_STREAM, 0); }
-	~ip_sock() { close(this->sock); }
-
-	inline auto& get_sock() { return this->sock; }
-	inline operator int() { return this->get_sock(); }
-	inline operator bool() { return (bool)this->get_sock(); }
-};
-
-template <class type, std::size_t size>
-class to_string
-{
-	type buf[size];
-public:
-	template <class... args>
-	to_string(const type* s, args&&... arg) { sprintf(this->buf, s, arg...); }
-
-	inline auto get() { return this->buf; }
-	inline operator type*() { return this->get(); }
-};
-
-template <std::size_t size>
-using to_ch_string = to_string<char, size>;
+#include "net.hpp"
+#include "util.hpp"
+#include "stats.hpp"
+#include "waiter.hpp"
+#include "tsc.hpp"
 
 int main(int argc, char** argv)
 {
@@ -48,13 +20,32 @@ int main(int argc, char** argv)
 
 	auto port = 1337;
 
-	if (argc <= 1)
+	if (argc <= 1 || std::strncmp(argv[1], "--", 2) == 0)
 		std::printf("argc <= 1, use default port\n");
 	else
 	{
 		port = std::atoi(argv[1]);
 	}
 
+	// --pipeline=N sends N newline framed messages per round and waits for the cumulative ack
+	auto pipeline = 0;
+	// --interval-ms=N pauses between rounds, --wait= picks how that pause is waited out
+	std::uint32_t interval_ms = 10 * 1000;
+	auto wait = wait_policy::power_saving();
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::strncmp(argv[i], "--pipeline=", 11) == 0)
+			pipeline = std::atoi(argv[i] + 11);
+		else if (std::strncmp(argv[i], "--interval-ms=", 14) == 0)
+			interval_ms = std::atoi(argv[i] + 14);
+		else if (std::strncmp(argv[i], "--wait=", 7) == 0 && !wait_policy::parse(argv[i] + 7, wait))
+			std::printf("unknown wait policy \"%s\"\n", argv[i] + 7);
+	}
+
+	hybrid_waiter waiter(wait);
+	auto interval = std::chrono::milliseconds(interval_ms);
+
 	to_ch_string<64 + 1> port_str("%d", port);
 
 	ip_sock sock;
@@ -77,14 +68,78 @@ int main(int argc, char** argv)
 		return 1;
 	}
 
+	latency_histogram round_trip;
+	auto round_start = tsc_clock::now();
+
+	auto record_round_trip = [&]()
+	{
+		round_trip.record(elapsed_ns(round_start));
+		round_trip.dump(stdout, "round trip");
+	};
+
+	if (pipeline > 0)
+	{
+		std::uint64_t sent = 0;
+		// acks are split into lines like the server's consume_lines does, a partial one waits for the next recv
+		char buf[128 + 1];
+		std::size_t fill = 0;
+
+		while (true)
+		{
+			waiter.wait_for(interval);
+
+			for (int i = 0; i < pipeline; i++)
+			{
+				to_ch_string<64 + 1> msg("Ehal greka cherez reku %llu\n", (unsigned long long)++sent);
+				send(sock, msg.get(), strlen(msg), 0);
+			}
+			round_start = tsc_clock::now();
+			std::printf("Messages sended %d\n", pipeline);
+
+			std::uint64_t acked = 0;
+			while (acked < sent)
+			{
+				auto received = recv(sock, buf + fill, sizeof(buf) - 1 - fill, 0);
+				if (received <= 0)
+					return 1;
+
+				fill += received;
+
+				auto begin = buf;
+				auto end = buf + fill;
+
+				for (auto nl = (char*)std::memchr(begin, '\n', end - begin); nl != nullptr; nl = (char*)std::memchr(begin, '\n', end - begin))
+				{
+					*nl = '\0';
+
+					if (std::strncmp(begin, "ACCEPTED ", 9) == 0)
+						acked = std::strtoull(begin + 9, nullptr, 10);
+
+					printf("Message from server: \"%s\"\n", begin);
+					begin = nl + 1;
+				}
+
+				fill = end - begin;
+				std::memmove(buf, begin, fill);
+
+				// a line that does not fit the buffer is no ack, it is dropped
+				if (fill == sizeof(buf) - 1)
+					fill = 0;
+			}
+
+			record_round_trip();
+		}
+	}
+
 	bool send_message = true;
 	while (true)
 	{	
 		if (send_message)
 		{
-			usleep(10 * 1000000);
+			waiter.wait_for(interval);
 			const char* funny_msg = "Ehal greka cherez reku";
 			send(sock, funny_msg, strlen(funny_msg), 0);
+			round_start = tsc_clock::now();
 			send_message = false;
 			std::printf("Message sended\n");
 		}
@@ -93,6 +148,7 @@ int main(int argc, char** argv)
 			char buf[128 + 1]{};
 			recv(sock, buf, sizeof(buf) - 1, 0);
 			printf("Message from server: \"%s\"\n", buf);
+			record_round_trip();
 			send_message = true;
 		}
 	}
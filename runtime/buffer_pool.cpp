@@ -0,0 +1,112 @@
+#include "buffer_pool.hpp"
+#include "placement.hpp"
+
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+
+buffer_pool::buffer_pool(std::size_t slot_size, std::size_t slots_per_region, buffer_pool_options options) :
+	_slot_size(slot_size), _slots_per_region(slots_per_region), _options(options)
+{
+	this->grow();
+}
+
+buffer_pool::~buffer_pool()
+{
+	for (auto& r : this->_regions)
+		munmap(r._base, r._size);
+}
+
+void buffer_pool::grow()
+{
+	constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+	auto page_size = (std::size_t)sysconf(_SC_PAGESIZE);
+	auto wanted = this->_slot_size * this->_slots_per_region;
+
+	region r{ nullptr, 0, false, false, false };
+
+	if (this->_options._huge_pages)
+	{
+		r._size = (wanted + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		auto mem = mmap(nullptr, r._size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if (mem != MAP_FAILED)
+		{
+			r._base = (char*)mem;
+			r._hugetlb = true;
+		}
+	}
+
+	if (r._base == nullptr)
+	{
+		r._size = (wanted + page_size - 1) & ~(page_size - 1);
+		auto mem = mmap(nullptr, r._size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (mem == MAP_FAILED)
+			throw std::bad_alloc();
+
+		r._base = (char*)mem;
+
+		if (this->_options._huge_pages)
+			r._transparent_huge_pages = madvise(r._base, r._size, MADV_HUGEPAGE) == 0;
+	}
+
+	// the policy only applies to pages faulted in afterwards, so it goes before the prefault
+	if (this->_options._numa_node >= 0)
+		bind_to_node(r._base, r._size, this->_options._numa_node);
+
+	if (this->_options._prefault)
+	{
+		for (std::size_t offset = 0; offset < r._size; offset += page_size)
+			((volatile char*)r._base)[offset] = 0;
+	}
+
+	if (this->_options._mlock)
+		r._locked = mlock(r._base, r._size) == 0;
+
+	this->_regions.push_back(r);
+
+	// the rounded up mapping holds more slots than asked for, hand them all out
+	auto slots = r._size / this->_slot_size;
+	this->_free.reserve(this->_free.size() + slots);
+
+	for (std::size_t i = slots; i-- > 0;)
+		this->_free.push_back(r._base + i * this->_slot_size);
+}
+
+const char* buffer_pool::page_kind() const
+{
+	if (this->_regions.empty() || !(this->_regions[0]._hugetlb || this->_regions[0]._transparent_huge_pages))
+		return "small pages";
+
+	return this->_regions[0]._hugetlb ? "hugetlb" : "transparent huge pages";
+}
+
+shared_buffer* shared_buffer::create(std::size_t capacity)
+{
+	auto mem = ::operator new(offsetof(shared_buffer, _data) + capacity);
+	auto buf = (shared_buffer*)mem;
+	buf->_refs = 1;
+	buf->_length = 0;
+	return buf;
+}
+
+char* byte_arena::allocate(std::size_t size)
+{
+	if (size > ARENA_BLOCK_SIZE / 4)
+	{
+		this->_large.push_back(std::make_unique<char[]>(size));
+		return this->_large.back().get();
+	}
+
+	if (this->_used + size > ARENA_BLOCK_SIZE)
+	{
+		this->_blocks.push_back(std::make_unique<char[]>(ARENA_BLOCK_SIZE));
+		this->_used = 0;
+	}
+
+	auto ptr = this->_blocks.back().get() + this->_used;
+	this->_used += size;
+	return ptr;
+}
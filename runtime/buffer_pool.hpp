@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <sys/uio.h>
+
+// How buffer_pool maps its regions. Huge pages use MAP_HUGETLB and fall back to transparent
+// huge pages when the hugetlb pool is empty; prefault touches every page up front so steady
+// state traffic takes no page faults; mlock keeps the region resident.
+struct buffer_pool_options
+{
+	bool _huge_pages = false;
+	bool _prefault = false;
+	bool _mlock = false;
+	int _numa_node = -1;
+};
+
+// Fixed size slots carved from large mmap'ed regions, acquire/release are a pop/push on a free
+// stack. Every region is one contiguous range, so it can be registered with a ring as a single
+// fixed buffer and any slot inside is addressed by the region index.
+class buffer_pool
+{
+	struct region
+	{
+		char* _base;
+		std::size_t _size;
+		bool _hugetlb;
+		bool _transparent_huge_pages;
+		bool _locked;
+	};
+
+	std::size_t _slot_size;
+	std::size_t _slots_per_region;
+	buffer_pool_options _options;
+	std::vector<region> _regions;
+	std::vector<char*> _free;
+	std::size_t _registered = 0;
+
+	void grow();
+public:
+	buffer_pool(std::size_t slot_size, std::size_t slots_per_region, buffer_pool_options options = {});
+	buffer_pool(const buffer_pool&) = delete;
+	~buffer_pool();
+
+	inline char* acquire()
+	{
+		if (this->_free.empty())
+			this->grow();
+
+		auto slot = this->_free.back();
+		this->_free.pop_back();
+		return slot;
+	}
+
+	inline void release(char* slot) { this->_free.push_back(slot); }
+	inline auto slot_size() const { return this->_slot_size; }
+
+	inline auto region_count() const { return this->_regions.size(); }
+	inline iovec region_iovec(std::size_t i) const { return { this->_regions[i]._base, this->_regions[i]._size }; }
+	inline auto locked() const { return !this->_regions.empty() && this->_regions[0]._locked; }
+
+	// What backs the first region: "hugetlb", "transparent huge pages" or "small pages"
+	const char* page_kind() const;
+
+	// The first count regions were registered with a ring as fixed buffers 0..count-1
+	inline void set_registered(std::size_t count) { this->_registered = count; }
+
+	// Fixed buffer index of the region holding ptr, -1 when that region is not registered
+	inline int fixed_index(const char* ptr) const
+	{
+		for (std::size_t i = 0; i < this->_registered; i++)
+		{
+			auto& r = this->_regions[i];
+
+			if (ptr >= r._base && ptr < r._base + r._size)
+				return (int)i;
+		}
+
+		return -1;
+	}
+};
+
+// Message payload stored once and shared by every connection it is queued on,
+// the last completed send releases it
+struct shared_buffer
+{
+	std::uint32_t _refs;
+	std::size_t _length;
+	char _data[1];
+
+	static shared_buffer* create(std::size_t capacity);
+
+	inline void add_ref() { this->_refs++; }
+
+	inline void release()
+	{
+		if (--this->_refs == 0)
+			::operator delete(this);
+	}
+
+	inline void append(const char* data, std::size_t length)
+	{
+		std::memcpy(this->_data + this->_length, data, length);
+		this->_length += length;
+	}
+};
+
+// Bump allocator, memory is only returned when the arena goes away
+class byte_arena
+{
+	static constexpr std::size_t ARENA_BLOCK_SIZE = 1024 * 1024;
+
+	std::vector<std::unique_ptr<char[]>> _blocks;
+	std::vector<std::unique_ptr<char[]>> _large;
+	std::size_t _used = ARENA_BLOCK_SIZE;
+public:
+	char* allocate(std::size_t size);
+};
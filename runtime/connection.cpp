@@ -0,0 +1,133 @@
+#include "connection.hpp"
+
+void out_queue::release_batch(batch& b)
+{
+	for (auto& c : b._chunks)
+	{
+		if (c._shared != nullptr)
+			c._shared->release();
+	}
+
+	b._arena.clear();
+	b._chunks.clear();
+	b._bytes = 0;
+}
+
+void out_queue::append(const char* data, std::size_t length)
+{
+	auto& b = this->_batches[this->_filling];
+	b._chunks.push_back({ nullptr, b._arena.size(), length });
+	b._arena.insert(b._arena.end(), data, data + length);
+	b._bytes += length;
+}
+
+void out_queue::append_shared(shared_buffer* shared)
+{
+	auto& b = this->_batches[this->_filling];
+	shared->add_ref();
+	b._chunks.push_back({ shared, 0, shared->_length });
+	b._bytes += shared->_length;
+}
+
+msghdr* out_queue::next_msg(int& flags)
+{
+	if (this->_sending == -1)
+	{
+		if (!this->pending())
+			return nullptr;
+
+		this->_sending = this->_filling;
+		this->_filling ^= 1;
+		this->_next_chunk = this->_chunk_offset = this->_sent = 0;
+	}
+
+	auto& b = this->_batches[this->_sending];
+	std::size_t iov_count = 0;
+	auto i = this->_next_chunk;
+
+	for (; i < b._chunks.size(); i++)
+	{
+		auto& c = b._chunks[i];
+		auto data = this->chunk_data(b, c);
+		auto length = c._length;
+
+		if (i == this->_next_chunk)
+		{
+			data += this->_chunk_offset;
+			length -= this->_chunk_offset;
+		}
+
+		// arena chunks are laid out back to back, extend the previous iovec instead of adding one
+		if (iov_count != 0 && (char*)this->_iov[iov_count - 1].iov_base + this->_iov[iov_count - 1].iov_len == data)
+		{
+			this->_iov[iov_count - 1].iov_len += length;
+			continue;
+		}
+
+		if (iov_count == MAX_IOV)
+			break;
+
+		this->_iov[iov_count++] = { (void*)data, length };
+	}
+
+	flags = MSG_NOSIGNAL | (i < b._chunks.size() ? MSG_MORE : 0);
+
+	this->_msg = {};
+	this->_msg.msg_iov = this->_iov;
+	this->_msg.msg_iovlen = iov_count;
+	return &this->_msg;
+}
+
+bool out_queue::complete(std::size_t sent)
+{
+	auto& b = this->_batches[this->_sending];
+	this->_sent += sent;
+
+	while (this->_next_chunk < b._chunks.size())
+	{
+		auto left = b._chunks[this->_next_chunk]._length - this->_chunk_offset;
+
+		if (sent < left)
+		{
+			this->_chunk_offset += sent;
+			return true;
+		}
+
+		sent -= left;
+		this->_next_chunk++;
+		this->_chunk_offset = 0;
+	}
+
+	this->release_batch(b);
+	this->_sending = -1;
+	this->_sent = 0;
+	return false;
+}
+
+void out_queue::reset()
+{
+	for (auto& b : this->_batches)
+		this->release_batch(b);
+
+	this->_filling = 0;
+	this->_sending = -1;
+	this->_sent = 0;
+}
+
+void subscriber_list::add(connection_t* conn)
+{
+	conn->_subscriber_index = this->_subscribers.size();
+	this->_subscribers.push_back(conn);
+}
+
+void subscriber_list::remove(connection_t* conn)
+{
+	if (conn->_subscriber_index == SIZE_MAX)
+		return;
+
+	auto last = this->_subscribers.back();
+	this->_subscribers[conn->_subscriber_index] = last;
+	last->_subscriber_index = conn->_subscriber_index;
+	this->_subscribers.pop_back();
+	conn->_subscriber_index = SIZE_MAX;
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "buffer_pool.hpp"
+#include "tsc.hpp"
+
+struct connection_t;
+
+// SQE user_data. The runtime owns the first few commands, applications number theirs from FIRST_USER_COMMAND
+struct uring_sock_udata_t
+{
+	enum runtime_command : std::uint32_t
+	{
+		COROUTINE,
+		CONNECTION_RECEIVE,
+		CONNECTION_SEND,
+		FIRST_USER_COMMAND
+	};
+
+	std::uint32_t _ucmd;
+	int _sock;
+	char* _received_data;
+	tsc_clock::time_point _timestamp;
+	connection_t* _conn;
+
+	uring_sock_udata_t(std::uint32_t ucmd, int sock, char* received_data = nullptr, tsc_clock::time_point _timestamp = {}, connection_t* conn = nullptr) : 
+		_ucmd(ucmd), _sock(sock), _received_data(received_data), _timestamp(_timestamp), _conn(conn)
+	{
+		
+	}
+};
+
+// Replies queued on a connection during a loop iteration, sent with one sendmsg per flush.
+// New replies go to the filling batch while the other batch is owned by the kernel, so the
+// memory an in-flight iovec points at never moves.
+class out_queue
+{
+public:
+	static constexpr std::size_t MAX_IOV = 64;
+private:
+	struct chunk
+	{
+		shared_buffer* _shared;
+		std::size_t _offset;
+		std::size_t _length;
+	};
+
+	struct batch
+	{
+		std::vector<char> _arena;
+		std::vector<chunk> _chunks;
+		std::size_t _bytes = 0;
+	};
+
+	batch _batches[2];
+	int _filling = 0;
+	int _sending = -1;
+	std::size_t _next_chunk = 0;
+	std::size_t _chunk_offset = 0;
+	// of the in-flight batch, already handed to the socket
+	std::size_t _sent = 0;
+
+	iovec _iov[MAX_IOV];
+	msghdr _msg{};
+
+	inline auto chunk_data(batch& b, const chunk& c) { return c._shared != nullptr ? (const char*)c._shared->_data : b._arena.data() + c._offset; }
+
+	void release_batch(batch& b);
+public:
+	// Copies the reply into the filling batch
+	void append(const char* data, std::size_t length);
+
+	// Queues a reference to a shared payload, held until its batch is sent
+	void append_shared(shared_buffer* shared);
+
+	inline auto sending() const { return this->_sending != -1; }
+	inline auto empty() const { return !this->sending() && this->_batches[this->_filling]._chunks.empty(); }
+	inline auto pending() const { return !this->_batches[this->_filling]._chunks.empty(); }
+	// Bytes still waiting to be sent, the sent part of the in-flight batch not included
+	inline auto queued_bytes() const { return this->_batches[0]._bytes + this->_batches[1]._bytes - this->_sent; }
+
+	// Builds the next sendmsg, either continuing the in-flight batch or taking the filling one
+	msghdr* next_msg(int& flags);
+
+	// Accounts for a completed sendmsg, returns true while the in-flight batch still has data
+	bool complete(std::size_t sent);
+
+	void reset();
+};
+
+// Per-socket slot with the receive and send ops embedded, so re-arming never allocates.
+// Applications derive from it to add protocol state and hide reset() with their own.
+// The receive buffer comes from the table's pool when it has one, the slot owns it otherwise.
+struct connection_t
+{
+	static constexpr std::size_t RECEIVE_BUFFER_SIZE = 4096;
+
+	int _sock;
+	std::size_t _subscriber_index;
+	bool _closing;
+	bool _dirty;
+	bool _send_inflight;
+	std::uint32_t _ops_inflight;
+
+	std::size_t _fill;
+	char* _recv_buffer;
+	// fixed buffer index of _recv_buffer in the ring, -1 when it is not registered
+	int _recv_fixed_index;
+	std::unique_ptr<char[]> _own_recv_buffer;
+
+	out_queue _out;
+
+	uring_sock_udata_t _recv_op;
+	uring_sock_udata_t _send_op;
+
+	connection_t(int sock, char* recv_buffer = nullptr, int recv_fixed_index = -1) : 
+		_recv_buffer(recv_buffer),
+		_recv_fixed_index(recv_fixed_index),
+		_recv_op(uring_sock_udata_t::CONNECTION_RECEIVE, sock, nullptr, {}, this),
+		_send_op(uring_sock_udata_t::CONNECTION_SEND, sock, nullptr, {}, this)
+	{
+		if (this->_recv_buffer == nullptr)
+		{
+			this->_own_recv_buffer = std::make_unique<char[]>(RECEIVE_BUFFER_SIZE);
+			this->_recv_buffer = this->_own_recv_buffer.get();
+		}
+
+		this->reset(sock);
+	}
+
+	void reset(int sock)
+	{
+		this->_sock = sock;
+		this->_subscriber_index = SIZE_MAX;
+		this->_closing = this->_dirty = this->_send_inflight = false;
+		this->_ops_inflight = 0;
+		this->_fill = 0;
+		this->_out.reset();
+		this->_recv_op._sock = this->_send_op._sock = sock;
+	}
+
+	// Splits the receive buffer into '\n' terminated messages and keeps the incomplete tail.
+	// A callback returning false stops the split after its line, the rest stays buffered.
+	template <class fn>
+	void consume_lines(std::size_t received, fn&& on_line)
+	{
+		this->_fill += received;
+
+		auto begin = this->_recv_buffer;
+		auto end = this->_recv_buffer + this->_fill;
+
+		while (begin < end)
+		{
+			auto nl = (char*)std::memchr(begin, '\n', end - begin);
+
+			if (nl == nullptr)
+				break;
+
+			auto line_end = nl;
+			if (line_end > begin && line_end[-1] == '\r')
+				line_end--;
+
+			if constexpr (std::is_same_v<decltype(on_line(begin, std::size_t{})), bool>)
+			{
+				if (!on_line(begin, (std::size_t)(line_end - begin)))
+				{
+					begin = nl + 1;
+					break;
+				}
+			}
+			else
+				on_line(begin, (std::size_t)(line_end - begin));
+
+			begin = nl + 1;
+		}
+
+		if (begin == this->_recv_buffer && this->_fill == RECEIVE_BUFFER_SIZE)
+		{
+			on_line(begin, this->_fill);
+			begin = end;
+		}
+
+		this->_fill = end - begin;
+		std::memmove(this->_recv_buffer, begin, this->_fill);
+	}
+};
+
+// Slots are indexed by fd; a slot is only handed out again once its fd was closed,
+// which happens after every op of the previous owner completed. A slot keeps its receive
+// buffer for its whole life, new slots take theirs from recv_buffers when one is given.
+template <class conn_type = connection_t>
+class connection_table
+{
+	std::vector<std::unique_ptr<conn_type>> _slots;
+	buffer_pool* _recv_buffers;
+public:
+	connection_table(buffer_pool* recv_buffers = nullptr) : _recv_buffers(recv_buffers) {}
+
+	conn_type* acquire(int sock)
+	{
+		if ((std::size_t)sock >= this->_slots.size())
+			this->_slots.resize(sock + 1);
+
+		auto& slot = this->_slots[sock];
+
+		if (!slot)
+		{
+			if (this->_recv_buffers != nullptr)
+			{
+				auto buffer = this->_recv_buffers->acquire();
+				slot = std::make_unique<conn_type>(sock, buffer, this->_recv_buffers->fixed_index(buffer));
+			}
+			else
+				slot = std::make_unique<conn_type>(sock);
+		}
+		else
+			slot->reset(sock);
+
+		return slot.get();
+	}
+
+	// Visits the slots whose fd is still open, released slots have _sock set to -1
+	template <class fn>
+	void for_each(fn&& visit)
+	{
+		for (auto& slot : this->_slots)
+		{
+			if (slot && slot->_sock >= 0)
+				visit(slot.get());
+		}
+	}
+};
+
+// Dense array of the connections a fan-out is delivered to, removal swaps in the last entry
+class subscriber_list
+{
+	std::vector<connection_t*> _subscribers;
+public:
+	void add(connection_t* conn);
+	void remove(connection_t* conn);
+
+	inline auto begin() { return this->_subscribers.begin(); }
+	inline auto end() { return this->_subscribers.end(); }
+	inline auto size() const { return this->_subscribers.size(); }
+};
@@ -0,0 +1,41 @@
+#include "coro.hpp"
+
+void* coro_frame_pool::allocate(std::size_t size)
+{
+	if (size > MAX_POOLED_SIZE)
+		return ::operator new(size);
+
+	auto cls = size_class(size);
+
+	if (auto node = this->_free[cls])
+	{
+		this->_free[cls] = node->_next;
+		return node;
+	}
+
+	auto bytes = (cls + 1) * GRANULARITY;
+
+	if (this->_chunk_used + bytes > CHUNK_SIZE)
+	{
+		this->_chunks.push_back(std::make_unique<char[]>(CHUNK_SIZE));
+		this->_chunk_used = 0;
+	}
+
+	auto ptr = this->_chunks.back().get() + this->_chunk_used;
+	this->_chunk_used += bytes;
+	return ptr;
+}
+
+void coro_frame_pool::deallocate(void* ptr, std::size_t size)
+{
+	if (size > MAX_POOLED_SIZE)
+	{
+		::operator delete(ptr);
+		return;
+	}
+
+	auto cls = size_class(size);
+	auto node = (free_node*)ptr;
+	node->_next = this->_free[cls];
+	this->_free[cls] = node;
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstddef>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <vector>
+
+#include "ring_loop.hpp"
+#include "timer.hpp"
+
+// Frames of the coroutine handlers come from size classed free lists carved out of large
+// chunks, so a steady state of connect/disconnect never reaches the global allocator
+class coro_frame_pool
+{
+	static constexpr std::size_t GRANULARITY = 64;
+	static constexpr std::size_t MAX_POOLED_SIZE = 4096;
+	static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+	struct free_node
+	{
+		free_node* _next;
+	};
+
+	free_node* _free[MAX_POOLED_SIZE / GRANULARITY]{};
+	std::vector<std::unique_ptr<char[]>> _chunks;
+	std::size_t _chunk_used = CHUNK_SIZE;
+
+	static inline auto size_class(std::size_t size) { return (size + GRANULARITY - 1) / GRANULARITY - 1; }
+public:
+	void* allocate(std::size_t size);
+	void deallocate(void* ptr, std::size_t size);
+};
+
+namespace coro
+{
+	// Loop and frame pool of the thread running it, awaiters and frames pick them up implicitly
+	struct worker
+	{
+		ring_loop* _loop;
+		coro_frame_pool _pool;
+
+		static inline thread_local worker* _current = nullptr;
+
+		static inline auto current() { return _current; }
+	};
+
+	// Detached coroutine, starts eagerly and frees its frame when it runs off the end
+	struct task
+	{
+		struct promise_type
+		{
+			task get_return_object() noexcept { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() noexcept {}
+			void unhandled_exception() noexcept { std::terminate(); }
+
+			static void* operator new(std::size_t size) { return worker::current()->_pool.allocate(size); }
+			static void operator delete(void* ptr, std::size_t size) { worker::current()->_pool.deallocate(ptr, size); }
+		};
+	};
+
+	// The awaiter lives in the suspended frame and is itself the CQE user_data,
+	// ring_loop stores the result and resumes _handle
+	struct io_awaiter : coro_resumable
+	{
+		io_awaiter(int sock) : coro_resumable{ uring_sock_udata_t(uring_sock_udata_t::COROUTINE, sock), {}, 0 } {}
+
+		inline bool await_ready() const noexcept { return false; }
+		inline int await_resume() const noexcept { return this->_res; }
+
+		io_uring_sqe* arm(std::coroutine_handle<> handle)
+		{
+			this->_handle = handle;
+
+			auto sqe = worker::current()->_loop->acquire_sqe();
+			io_uring_sqe_set_data(sqe, &this->_op);
+			return sqe;
+		}
+	};
+
+	struct accept_awaiter : io_awaiter
+	{
+		accept_awaiter(int sock) : io_awaiter(sock) {}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			io_uring_prep_accept(this->arm(handle), this->_op._sock, nullptr, nullptr, 0);
+		}
+	};
+
+	struct recv_awaiter : io_awaiter
+	{
+		char* _buffer;
+		std::size_t _length;
+
+		recv_awaiter(int sock, char* buffer, std::size_t length) : io_awaiter(sock), _buffer(buffer), _length(length) {}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			io_uring_prep_recv(this->arm(handle), this->_op._sock, this->_buffer, this->_length, 0);
+		}
+	};
+
+	struct send_awaiter : io_awaiter
+	{
+		const char* _buffer;
+		std::size_t _length;
+
+		send_awaiter(int sock, const char* buffer, std::size_t length) : io_awaiter(sock), _buffer(buffer), _length(length) {}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			io_uring_prep_send(this->arm(handle), this->_op._sock, this->_buffer, this->_length, MSG_NOSIGNAL);
+		}
+	};
+
+	struct sleep_awaiter : io_awaiter
+	{
+		__kernel_timespec _kts;
+
+		template <class rep, class per>
+		sleep_awaiter(std::chrono::duration<rep, per> t) : io_awaiter(-1), _kts(to_kts(t)) {}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			io_uring_prep_timeout(this->arm(handle), &this->_kts, 0, 0);
+		}
+	};
+
+	inline auto accept(int sock) { return accept_awaiter(sock); }
+	inline auto recv(int sock, char* buffer, std::size_t length) { return recv_awaiter(sock, buffer, length); }
+	inline auto send(int sock, const char* buffer, std::size_t length) { return send_awaiter(sock, buffer, length); }
+
+	template <class rep, class per>
+	inline auto sleep(std::chrono::duration<rep, per> t) { return sleep_awaiter(t); }
+}
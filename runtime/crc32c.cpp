@@ -0,0 +1,76 @@
+#include "crc32c.hpp"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// reflected 0x1EDC6F41
+static constexpr std::uint32_t CRC32C_POLY = 0x82F63B78;
+
+static constexpr std::array<std::uint32_t, 256> make_table()
+{
+	std::array<std::uint32_t, 256> table{};
+
+	for (std::uint32_t i = 0; i < 256; i++)
+	{
+		auto crc = i;
+
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+
+		table[i] = crc;
+	}
+
+	return table;
+}
+
+static constexpr auto CRC32C_TABLE = make_table();
+
+std::uint32_t crc32c_table(const void* data, std::size_t length, std::uint32_t crc)
+{
+	auto bytes = (const std::uint8_t*)data;
+	crc = ~crc;
+
+	for (std::size_t i = 0; i < length; i++)
+		crc = CRC32C_TABLE[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static std::uint32_t crc32c_sse42(const void* data, std::size_t length, std::uint32_t crc)
+{
+	auto bytes = (const std::uint8_t*)data;
+	std::uint64_t value = ~crc;
+
+	for (; length >= 8; bytes += 8, length -= 8)
+	{
+		std::uint64_t word;
+		std::memcpy(&word, bytes, sizeof(word));
+		value = _mm_crc32_u64(value, word);
+	}
+
+	auto crc32 = (std::uint32_t)value;
+
+	for (; length != 0; bytes++, length--)
+		crc32 = _mm_crc32_u8(crc32, *bytes);
+
+	return ~crc32;
+}
+#endif
+
+std::uint32_t crc32c(const void* data, std::size_t length, std::uint32_t crc)
+{
+#if defined(__x86_64__)
+	static const bool sse42 = __builtin_cpu_supports("sse4.2");
+
+	if (sse42)
+		return crc32c_sse42(data, length, crc);
+#endif
+
+	return crc32c_table(data, length, crc);
+}
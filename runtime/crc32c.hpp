@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli), the polynomial of the SSE4.2 crc32 instruction. Pass a previous result as
+// crc to continue it over more data.
+std::uint32_t crc32c(const void* data, std::size_t length, std::uint32_t crc = 0);
+
+// Table driven version, what crc32c falls back to on CPUs without SSE4.2
+std::uint32_t crc32c_table(const void* data, std::size_t length, std::uint32_t crc = 0);
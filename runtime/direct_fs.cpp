@@ -0,0 +1,199 @@
+#include "direct_fs.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+direct_fs::direct_fs(const char* filename)
+{
+	this->_fd = open(filename, O_RDWR | O_CREAT | O_DIRECT | O_CLOEXEC, 0644);
+
+	if (this->_fd < 0)
+		return;
+
+	// at most one write per block is in flight
+	this->_ring_ready = io_uring_queue_init(4, &this->_ring, 0) >= 0;
+
+	iovec iovecs[2];
+
+	for (int i = 0; i < 2; i++)
+	{
+		this->_blocks[i]._data = (char*)std::aligned_alloc(SECTOR_BYTES, BLOCK_BYTES);
+		iovecs[i] = { this->_blocks[i]._data, BLOCK_BYTES };
+	}
+
+	if (!this->_ring_ready || this->_blocks[0]._data == nullptr || this->_blocks[1]._data == nullptr || !this->open_tail())
+	{
+		close(this->_fd);
+		this->_fd = -1;
+		return;
+	}
+
+	// registered blocks skip the page pinning of every write, like the receive buffers
+	this->_registered = io_uring_register_buffers(&this->_ring, iovecs, 2) == 0;
+}
+
+direct_fs::~direct_fs()
+{
+	if (this->is_open())
+	{
+		this->flush();
+		this->wait(0);
+		this->wait(1);
+	}
+
+	if (this->_ring_ready)
+		io_uring_queue_exit(&this->_ring);
+
+	if (this->_fd >= 0)
+		close(this->_fd);
+
+	std::free(this->_blocks[0]._data);
+	std::free(this->_blocks[1]._data);
+}
+
+// Starts the first block at the sector holding the end of the log, with the part of it that is
+// written. The end is the last byte that is not padding; the padding of a write is less than a
+// sector, but a crash in the middle of one may leave whole sectors of zeros.
+bool direct_fs::open_tail()
+{
+	struct stat st;
+
+	if (fstat(this->_fd, &st) != 0)
+		return false;
+
+	std::uint64_t size = st.st_size;
+	auto& first = this->_blocks[0];
+
+	while (size != 0)
+	{
+		auto offset = (size - 1) & ~(std::uint64_t)(SECTOR_BYTES - 1);
+		auto ret = pread(this->_fd, first._data, SECTOR_BYTES, offset);
+
+		if (ret < 0)
+			return false;
+
+		auto end = std::min<std::uint64_t>(ret, size - offset);
+
+		while (end != 0 && first._data[end - 1] == '\0')
+			end--;
+
+		if (end != 0)
+		{
+			first._offset = offset;
+			first._fill = this->_flushed = end;
+			return true;
+		}
+
+		size = offset;
+	}
+
+	return true;
+}
+
+void direct_fs::submit(int index)
+{
+	auto& b = this->_blocks[index];
+	auto length = (b._fill + SECTOR_BYTES - 1) & ~(SECTOR_BYTES - 1);
+	std::memset(b._data + b._fill, 0, length - b._fill);
+
+	// two writes at most, the ring always has room
+	auto sqe = io_uring_get_sqe(&this->_ring);
+
+	if (this->_registered)
+		io_uring_prep_write_fixed(sqe, this->_fd, b._data, length, b._offset, index);
+	else
+		io_uring_prep_write(sqe, this->_fd, b._data, length, b._offset);
+
+	io_uring_sqe_set_data64(sqe, index);
+	io_uring_submit(&this->_ring);
+
+	b._write_length = length;
+	b._inflight = true;
+}
+
+// Takes the completed writes, with wait at least one
+void direct_fs::reap(bool wait)
+{
+	io_uring_cqe* cqe;
+
+	while ((wait ? io_uring_wait_cqe(&this->_ring, &cqe) : io_uring_peek_cqe(&this->_ring, &cqe)) == 0)
+	{
+		auto& b = this->_blocks[io_uring_cqe_get_data64(cqe)];
+
+		if (cqe->res != (int)b._write_length)
+			this->_failed = true;
+
+		b._inflight = false;
+		io_uring_cqe_seen(&this->_ring, cqe);
+		wait = false;
+	}
+}
+
+void direct_fs::wait(int index)
+{
+	while (this->_blocks[index]._inflight)
+		this->reap(true);
+}
+
+direct_fs& direct_fs::write_string(const char* string, std::size_t length)
+{
+	while (length != 0)
+	{
+		auto& b = this->_blocks[this->_filling];
+
+		if (b._fill == BLOCK_BYTES)
+		{
+			this->flush();
+			continue;
+		}
+
+		auto n = std::min(length, BLOCK_BYTES - b._fill);
+		std::memcpy(b._data + b._fill, string, n);
+
+		b._fill += n;
+		string += n;
+		length -= n;
+	}
+
+	return *this;
+}
+
+direct_fs& direct_fs::flush()
+{
+	this->reap(false);
+
+	auto index = this->_filling;
+	auto& b = this->_blocks[index];
+
+	if (b._fill == this->_flushed)
+		return *this;
+
+	// the other block's write may cover the sector this one starts with
+	auto other = index ^ 1;
+	this->wait(other);
+	this->submit(index);
+
+	// the next block starts at the sector the write ends in, with the written part of it
+	auto& next = this->_blocks[other];
+	auto sector = b._fill & ~(SECTOR_BYTES - 1);
+	next._offset = b._offset + sector;
+	next._fill = this->_flushed = b._fill - sector;
+	std::memcpy(next._data, b._data + sector, next._fill);
+
+	this->_filling = other;
+	return *this;
+}
+
+bool direct_fs::sync()
+{
+	this->flush();
+	this->wait(0);
+	this->wait(1);
+
+	return !this->_failed && fdatasync(this->_fd) == 0;
+}
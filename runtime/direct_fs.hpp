@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <liburing.h>
+
+// A text log written with O_DIRECT, so appends neither fill the page cache nor wait in writeback.
+// Lines collect in one of two aligned blocks. flush() hands the filled part of the block to the
+// writer's own ring, rounded up to whole sectors with NUL bytes, and appending goes on in the
+// other block while the write is in flight. A block starts at a sector boundary, so a partly
+// filled last sector is copied into the next block and written again with what follows it. A
+// block is only written once the other block's write completed, which keeps overlapping writes
+// in order and is normally the case by the next loop iteration.
+// Padding rule: the NUL bytes at the end of the file are padding, NULs inside records are data.
+// The padding is never truncated, since after a hot upgrade the next process appends to the same
+// file, so readers skip it like recover_log does, and a new writer starts over it.
+class direct_fs
+{
+public:
+	static constexpr std::size_t SECTOR_BYTES = 4096;
+	static constexpr std::size_t BLOCK_BYTES = 1024 * 1024;
+private:
+	struct block
+	{
+		char* _data = nullptr;
+		// file offset of _data[0], a sector boundary
+		std::uint64_t _offset = 0;
+		std::size_t _fill = 0;
+		// bytes of the write in flight, padding included
+		std::size_t _write_length = 0;
+		bool _inflight = false;
+	};
+
+	int _fd = -1;
+	io_uring _ring;
+	bool _ring_ready = false;
+	bool _registered = false;
+	bool _failed = false;
+	block _blocks[2];
+	int _filling = 0;
+	// of the filling block at its last write, flush() skips a block that did not grow since
+	std::size_t _flushed = 0;
+
+	void submit(int index);
+	void reap(bool wait);
+	void wait(int index);
+	bool open_tail();
+public:
+	direct_fs(const char* filename);
+	direct_fs(const direct_fs&) = delete;
+	~direct_fs();
+
+	// False when the file system refuses O_DIRECT or the ring could not be set up
+	inline bool is_open() const { return this->_fd >= 0 && this->_ring_ready; }
+
+	direct_fs& write_string(const char* string, std::size_t length);
+
+	// Submits what was appended since the last flush and switches blocks, does not wait
+	direct_fs& flush();
+
+	// Waits for every write and until the data is on disk, false when a write or fdatasync failed
+	bool sync();
+};
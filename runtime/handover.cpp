@@ -0,0 +1,210 @@
+#include "handover.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static constexpr std::uint32_t HANDOVER_MAGIC = 0x31564f48; // "HOV1"
+static constexpr std::size_t FDS_PER_MESSAGE = 64;
+
+struct handover_header
+{
+	std::uint32_t _magic;
+	std::uint32_t _listeners;
+	std::uint32_t _connections;
+};
+
+static bool make_address(const char* path, sockaddr_un& addr)
+{
+	if (std::strlen(path) >= sizeof(addr.sun_path))
+		return false;
+
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strcpy(addr.sun_path, path);
+	return true;
+}
+
+static bool send_batch(int channel, const void* data, std::size_t length, const int* fds, std::size_t fd_count)
+{
+	iovec iov{ (void*)data, length };
+	char control[CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE)]{};
+
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (fd_count != 0)
+	{
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+		std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+	}
+
+	return sendmsg(channel, &msg, MSG_NOSIGNAL) == (ssize_t)length;
+}
+
+// Returns the bytes received, the fds that came along are appended in order
+static ssize_t receive_batch(int channel, void* data, std::size_t length, std::vector<int>& fds)
+{
+	iovec iov{ data, length };
+	char control[CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE)]{};
+
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	auto received = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+
+	if (received < 0)
+		return -1;
+
+	// a truncated message still installs the descriptors that fit, they go to fds for closing
+	for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		auto first = (const int*)CMSG_DATA(cmsg);
+		fds.insert(fds.end(), first, first + count);
+	}
+
+	if (received == 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0)
+		return -1;
+
+	return received;
+}
+
+int handover_listen(const char* path)
+{
+	sockaddr_un addr;
+
+	if (!make_address(path, addr))
+		return -1;
+
+	auto sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+	if (sock < 0)
+		return -1;
+
+	unlink(path);
+
+	if (bind(sock, (const sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 1) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+bool handover_send(int channel, const std::vector<int>& listeners, const std::vector<handover_fd>& connections)
+{
+	handover_header header{ HANDOVER_MAGIC, (std::uint32_t)listeners.size(), (std::uint32_t)connections.size() };
+
+	if (!send_batch(channel, &header, sizeof(header), nullptr, 0))
+		return false;
+
+	if (!listeners.empty() && !send_batch(channel, &header, sizeof(header), listeners.data(), listeners.size()))
+		return false;
+
+	for (std::size_t i = 0; i < connections.size(); i += FDS_PER_MESSAGE)
+	{
+		auto count = std::min(FDS_PER_MESSAGE, connections.size() - i);
+
+		int fds[FDS_PER_MESSAGE];
+		std::uint64_t seqs[FDS_PER_MESSAGE];
+
+		for (std::size_t j = 0; j < count; j++)
+		{
+			fds[j] = connections[i + j]._fd;
+			seqs[j] = connections[i + j]._seq;
+		}
+
+		if (!send_batch(channel, seqs, sizeof(std::uint64_t) * count, fds, count))
+			return false;
+	}
+
+	return true;
+}
+
+bool handover_receive(const char* path, std::vector<int>& listeners, std::vector<handover_fd>& connections)
+{
+	sockaddr_un addr;
+
+	if (!make_address(path, addr))
+		return false;
+
+	auto channel = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+	if (channel < 0)
+		return false;
+
+	std::vector<int> fds;
+	std::vector<int> received_listeners;
+	std::vector<handover_fd> received_connections;
+
+	// nothing reaches the caller on failure, so every descriptor received so far is closed
+	auto fail = [&]()
+	{
+		for (auto fd : fds)
+			close(fd);
+
+		for (auto fd : received_listeners)
+			close(fd);
+
+		for (auto& conn : received_connections)
+			close(conn._fd);
+
+		close(channel);
+		return false;
+	};
+
+	if (connect(channel, (const sockaddr*)&addr, sizeof(addr)) != 0)
+		return fail();
+
+	handover_header header;
+
+	if (receive_batch(channel, &header, sizeof(header), fds) != sizeof(header) || header._magic != HANDOVER_MAGIC || !fds.empty())
+		return fail();
+
+	if (header._listeners != 0)
+	{
+		handover_header repeated;
+
+		if (receive_batch(channel, &repeated, sizeof(repeated), fds) != sizeof(repeated) || fds.size() != header._listeners)
+			return fail();
+
+		received_listeners.swap(fds);
+	}
+
+	while (received_connections.size() < header._connections)
+	{
+		std::uint64_t seqs[FDS_PER_MESSAGE];
+
+		auto received = receive_batch(channel, seqs, sizeof(seqs), fds);
+
+		if (received <= 0 || fds.size() != received / sizeof(std::uint64_t))
+			return fail();
+
+		for (std::size_t i = 0; i < fds.size(); i++)
+			received_connections.push_back({ fds[i], seqs[i] });
+
+		fds.clear();
+	}
+
+	close(channel);
+	listeners.insert(listeners.end(), received_listeners.begin(), received_listeners.end());
+	connections.insert(connections.end(), received_connections.begin(), received_connections.end());
+	return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Hot upgrade channel: the running server passes its listening sockets and idle connections to
+// a new process over a SOCK_SEQPACKET unix socket with SCM_RIGHTS. Every fd travels with a
+// small record, connections carry the last sequence number their client was acked.
+
+struct handover_fd
+{
+	int _fd;
+	std::uint64_t _seq;
+};
+
+// Bound and listening channel at path, a stale socket file left there is replaced. -1 on failure
+int handover_listen(const char* path);
+
+// Sends the listeners, then the connections, in batches that fit one SCM_RIGHTS message
+bool handover_send(int channel, const std::vector<int>& listeners, const std::vector<handover_fd>& connections);
+
+// Connects to the running server at path and receives everything handover_send sent
+bool handover_receive(const char* path, std::vector<int>& listeners, std::vector<handover_fd>& connections);
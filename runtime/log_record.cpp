@@ -0,0 +1,15 @@
+#include "log_record.hpp"
+
+#include "crc32c.hpp"
+
+static constexpr std::size_t CRC_OFFSET = sizeof(log_record_header::_crc);
+
+std::uint32_t log_record_header_crc(const log_record_header& header)
+{
+	return crc32c((const char*)&header + CRC_OFFSET, sizeof(header) - CRC_OFFSET);
+}
+
+std::uint32_t log_record_crc(const log_record_header& header, const char* payload)
+{
+	return crc32c(payload, header._length, log_record_header_crc(header));
+}
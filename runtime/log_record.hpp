@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Binary message log record: this header, then _length payload bytes. The CRC32C covers the
+// header fields after it and the payload, so a torn or corrupted record fails as a whole.
+// _sequence numbers the records of one log from 0. _timestamp is a hybrid of CLOCK_REALTIME in
+// ns and a counter: a record stamped while the clock stands still or was stepped back takes the
+// previous timestamp + 1, so timestamps strictly increase along a log and stay close to real
+// time. The top 16 bits of _connection are the worker whose log shard holds the record.
+struct log_record_header
+{
+	std::uint32_t _crc;
+	std::uint32_t _length;
+	std::uint64_t _timestamp;
+	std::uint64_t _connection;
+	std::uint64_t _sequence;
+};
+
+static_assert(sizeof(log_record_header) == 32);
+
+// CRC of the header fields alone, log_record_crc continues it over the payload. A payload that
+// arrives in parts is checksummed by continuing it with crc32c part by part.
+std::uint32_t log_record_header_crc(const log_record_header& header);
+
+std::uint32_t log_record_crc(const log_record_header& header, const char* payload);
+
+// A placeholder holds the place of a record whose payload is still being written into the log.
+// Its _crc is the complement of log_record_header_crc, which no record's own CRC matches, and
+// the header is rewritten with the real CRC once the payload is complete. Readers step over a
+// placeholder; one whose payload never completed stays in the log unless it is at the tail,
+// which recovery cuts off.
+inline std::uint32_t log_placeholder_crc(const log_record_header& header) { return ~log_record_header_crc(header); }
+inline bool is_log_placeholder(const log_record_header& header) { return header._crc == log_placeholder_crc(header); }
+
+// Decodes the record at the start of [data, data + length), false when it is cut short or fails
+// its CRC. A placeholder decodes too, see is_log_placeholder.
+inline bool read_log_record(const char* data, std::size_t length, log_record_header& header, const char*& payload)
+{
+	if (length < sizeof(log_record_header))
+		return false;
+
+	std::memcpy(&header, data, sizeof(header));
+	payload = data + sizeof(header);
+
+	return header._length <= length - sizeof(header) && (is_log_placeholder(header) || log_record_crc(header, payload) == header._crc);
+}
+
+// Calls on_record(header, payload) for every valid record from the start of [data, data + length)
+// and returns the bytes they cover, placeholders included. The first record that is cut short
+// or fails its CRC ends the walk, and with it the usable part of the log. An on_record returning
+// bool stops the walk with false, the bytes returned then end in front of that record.
+template <class fn>
+std::size_t for_each_log_record(const char* data, std::size_t length, fn&& on_record)
+{
+	std::size_t offset = 0;
+
+	log_record_header header;
+	const char* payload;
+
+	while (read_log_record(data + offset, length - offset, header, payload))
+	{
+		if constexpr (std::is_same_v<decltype(on_record(header, payload)), bool>)
+		{
+			if (!on_record(header, payload))
+				break;
+		}
+		else
+			on_record(header, payload);
+
+		offset += sizeof(header) + header._length;
+	}
+
+	return offset;
+}
@@ -0,0 +1,129 @@
+#include "log_recovery.hpp"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+line_scan scan_lines_scalar(const char* data, std::size_t length)
+{
+	line_scan scan;
+
+	for (std::size_t i = 0; i < length; i++)
+	{
+		if (data[i] == '\n')
+		{
+			scan._records++;
+			scan._end = i + 1;
+		}
+	}
+
+	return scan;
+}
+
+#if defined(__SSE2__)
+static inline std::uint64_t match_mask(const char* block, __m128i byte)
+{
+	std::uint64_t mask = 0;
+
+	for (int i = 0; i < 4; i++)
+	{
+		auto chunk = _mm_loadu_si128((const __m128i*)(block + i * 16));
+		mask |= (std::uint64_t)(std::uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, byte)) << (i * 16);
+	}
+
+	return mask;
+}
+#endif
+
+line_scan scan_lines(const char* data, std::size_t length)
+{
+#if defined(__SSE2__)
+	line_scan scan;
+	auto newline = _mm_set1_epi8('\n');
+	std::size_t i = 0;
+
+	for (; i + 64 <= length; i += 64)
+	{
+		auto newlines = match_mask(data + i, newline);
+
+		if (newlines != 0)
+		{
+			scan._records += __builtin_popcountll(newlines);
+			scan._end = i + 64 - __builtin_clzll(newlines);
+		}
+	}
+
+	auto tail = scan_lines_scalar(data + i, length - i);
+	scan._records += tail._records;
+
+	if (tail._end != 0)
+		scan._end = i + tail._end;
+
+	return scan;
+#else
+	return scan_lines_scalar(data, length);
+#endif
+}
+
+// Length of data without the run of NUL bytes at its end
+static std::size_t trim_zeros(const char* data, std::size_t length)
+{
+	while (length != 0 && data[length - 1] == '\0')
+		length--;
+
+	return length;
+}
+
+log_recovery recover_log(const char* path)
+{
+	log_recovery recovery;
+
+	auto fd = open(path, O_RDWR | O_CLOEXEC);
+
+	if (fd < 0)
+	{
+		recovery._ok = errno == ENOENT;
+		return recovery;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return recovery;
+	}
+
+	std::uint64_t size = st.st_size;
+
+	if (size != 0)
+	{
+		auto data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (data == MAP_FAILED)
+		{
+			close(fd);
+			return recovery;
+		}
+
+		madvise(data, size, MADV_SEQUENTIAL);
+
+		// zeros past the last record are torn, the ones inside a record are message bytes
+		auto scan = scan_lines((const char*)data, trim_zeros((const char*)data, size));
+		munmap(data, size);
+
+		recovery._records = scan._records;
+		recovery._valid_bytes = scan._end;
+		recovery._torn_bytes = size - scan._end;
+	}
+
+	recovery._ok = recovery._torn_bytes == 0 || (ftruncate(fd, recovery._valid_bytes) == 0 && fsync(fd) == 0);
+	close(fd);
+	return recovery;
+}
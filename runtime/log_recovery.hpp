@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Newline terminated records found in a buffer. end is the offset just past the last complete
+// record. NUL bytes are data like any other, messages may carry them.
+struct line_scan
+{
+	std::uint64_t _records = 0;
+	std::uint64_t _end = 0;
+};
+
+// 64 bytes per step with SSE2 compares where available, the scalar loop otherwise
+line_scan scan_lines(const char* data, std::size_t length);
+
+// Byte at a time reference of scan_lines
+line_scan scan_lines_scalar(const char* data, std::size_t length);
+
+struct log_recovery
+{
+	bool _ok = false;
+	std::uint64_t _records = 0;
+	std::uint64_t _valid_bytes = 0;
+	std::uint64_t _torn_bytes = 0;
+	// binary logs: the sequence number the next appended record takes and the timestamp of the
+	// last record, which the next one has to exceed
+	std::uint64_t _next_sequence = 0;
+	std::uint64_t _last_timestamp = 0;
+};
+
+// Maps the log, keeps every complete record and truncates whatever follows the last one, so
+// appending resumes on a record boundary. The zeros at the end of the file are left out of the
+// scan first: a crash while the file was extended reads back as zeros, and direct_fs pads with
+// them. A missing file recovers as an empty log.
+log_recovery recover_log(const char* path);
@@ -0,0 +1,558 @@
+#include "log_segment.hpp"
+
+#include "crc32c.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string_view>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static std::uint64_t realtime_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (std::uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Zero padded, so the names also sort by sequence in a directory listing
+static log_segment make_segment(const std::string& dir, std::uint64_t first_sequence)
+{
+	char name[32];
+	std::snprintf(name, sizeof(name), "%020llu", (unsigned long long)first_sequence);
+
+	auto base = dir + "/" + name;
+	return { first_sequence, base + ".log", base + ".idx" };
+}
+
+static bool write_all(int fd, const void* data, std::size_t length)
+{
+	std::size_t written = 0;
+
+	while (written < length)
+	{
+		auto ret = write(fd, (const char*)data + written, length - written);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			return false;
+
+		written += ret;
+	}
+
+	return true;
+}
+
+static bool write_all_at(int fd, const void* data, std::size_t length, std::uint64_t offset)
+{
+	std::size_t written = 0;
+
+	while (written < length)
+	{
+		auto ret = pwrite(fd, (const char*)data + written, length - written, offset + written);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			return false;
+
+		written += ret;
+	}
+
+	return true;
+}
+
+// A created or removed segment only survives a crash once its directory entry is synced too
+static void sync_dir(const std::string& dir)
+{
+	auto fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0)
+		return;
+
+	fsync(fd);
+	close(fd);
+}
+
+static bool is_indexed(const log_record_header& header, std::uint64_t offset, std::uint32_t index_interval)
+{
+	return offset == 0 || (index_interval != 0 && header._sequence % index_interval == 0);
+}
+
+std::vector<log_segment> list_log_segments(const char* dir)
+{
+	std::vector<log_segment> segments;
+
+	auto d = opendir(dir);
+
+	if (d == nullptr)
+		return segments;
+
+	while (auto entry = readdir(d))
+	{
+		std::string_view name(entry->d_name);
+
+		if (name.size() != 24 || !name.ends_with(".log"))
+			continue;
+
+		char* end;
+		auto first_sequence = std::strtoull(entry->d_name, &end, 10);
+
+		if (end != entry->d_name + 20)
+			continue;
+
+		segments.push_back(make_segment(dir, first_sequence));
+	}
+
+	closedir(d);
+
+	std::sort(segments.begin(), segments.end(), [](const log_segment& a, const log_segment& b)
+	{
+		return a._first_sequence < b._first_sequence;
+	});
+
+	return segments;
+}
+
+std::vector<log_index_entry> read_log_index(const char* path)
+{
+	std::vector<log_index_entry> index;
+
+	auto fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return index;
+
+	struct stat st;
+
+	if (fstat(fd, &st) == 0)
+	{
+		index.resize(st.st_size / sizeof(log_index_entry));
+
+		auto length = index.size() * sizeof(log_index_entry);
+		std::size_t done = 0;
+
+		while (done < length)
+		{
+			auto ret = read(fd, (char*)index.data() + done, length - done);
+
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			if (ret <= 0)
+				break;
+
+			done += ret;
+		}
+
+		index.resize(done / sizeof(log_index_entry));
+	}
+
+	close(fd);
+	return index;
+}
+
+// Offset of the record with from_sequence, or of the first one after it. The walk starts at the
+// last index entry in front of it, so it reads at most an index interval of records.
+static std::uint64_t find_record(int fd, std::uint64_t size, const log_segment& segment, std::uint64_t from_sequence)
+{
+	auto index = read_log_index(segment._index_path.c_str());
+
+	auto it = std::partition_point(index.begin(), index.end(), [from_sequence](const log_index_entry& entry)
+	{
+		return entry._sequence <= from_sequence;
+	});
+
+	std::uint64_t start = it == index.begin() ? 0 : (it - 1)->_offset;
+
+	if (start >= size)
+		return size;
+
+	auto data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (data == MAP_FAILED)
+		return start;
+
+	auto skipped = for_each_log_record((const char*)data + start, size - start, [from_sequence](const log_record_header& header, const char*)
+	{
+		return header._sequence < from_sequence;
+	});
+
+	munmap(data, size);
+	return start + skipped;
+}
+
+std::vector<log_span> open_log_spans(const char* dir, std::uint64_t from_sequence)
+{
+	std::vector<log_span> spans;
+
+	auto segments = list_log_segments(dir);
+	std::size_t first = 0;
+
+	while (first + 1 < segments.size() && segments[first + 1]._first_sequence <= from_sequence)
+		first++;
+
+	for (auto i = first; i < segments.size(); i++)
+	{
+		auto fd = open(segments[i]._path.c_str(), O_RDONLY | O_CLOEXEC);
+
+		if (fd < 0)
+			continue;
+
+		struct stat st;
+
+		if (fstat(fd, &st) != 0)
+		{
+			close(fd);
+			continue;
+		}
+
+		std::uint64_t size = st.st_size;
+		std::uint64_t offset = 0;
+
+		if (i == first && from_sequence > segments[i]._first_sequence)
+			offset = find_record(fd, size, segments[i], from_sequence);
+
+		if (offset >= size)
+		{
+			close(fd);
+			continue;
+		}
+
+		spans.push_back({ fd, offset, size - offset });
+	}
+
+	return spans;
+}
+
+void remove_log_segments(const char* dir)
+{
+	for (auto& segment : list_log_segments(dir))
+	{
+		unlink(segment._path.c_str());
+		unlink(segment._index_path.c_str());
+	}
+}
+
+log_recovery recover_segmented_log(const char* dir, std::uint32_t index_interval)
+{
+	log_recovery recovery;
+
+	auto segments = list_log_segments(dir);
+
+	if (segments.empty())
+	{
+		recovery._ok = true;
+		return recovery;
+	}
+
+	auto& segment = segments.back();
+	recovery._next_sequence = segment._first_sequence;
+
+	auto fd = open(segment._path.c_str(), O_RDWR | O_CLOEXEC);
+
+	if (fd < 0)
+		return recovery;
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return recovery;
+	}
+
+	std::uint64_t size = st.st_size;
+	std::vector<log_index_entry> index;
+
+	if (size != 0)
+	{
+		auto data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (data == MAP_FAILED)
+		{
+			close(fd);
+			return recovery;
+		}
+
+		madvise(data, size, MADV_SEQUENTIAL);
+
+		// placeholders behind the last complete record never completed, so they are torn along
+		// with the rest of the tail
+		std::size_t committed_index = 0;
+
+		for_each_log_record((const char*)data, size, [&](const log_record_header& header, const char* payload)
+		{
+			auto offset = payload - sizeof(header) - (const char*)data;
+
+			if (is_indexed(header, offset, index_interval))
+				index.push_back({ header._timestamp, header._sequence, (std::uint64_t)offset });
+
+			if (is_log_placeholder(header))
+				return;
+
+			recovery._records++;
+			recovery._next_sequence = header._sequence + 1;
+			recovery._last_timestamp = header._timestamp;
+			recovery._valid_bytes = offset + sizeof(header) + header._length;
+			committed_index = index.size();
+		});
+
+		munmap(data, size);
+		index.resize(committed_index);
+		recovery._torn_bytes = size - recovery._valid_bytes;
+	}
+
+	recovery._ok = recovery._torn_bytes == 0 || (ftruncate(fd, recovery._valid_bytes) == 0 && fsync(fd) == 0);
+	close(fd);
+
+	if (recovery._records == 0 && segments.size() > 1)
+	{
+		auto sealed = read_log_index(segments[segments.size() - 2]._index_path.c_str());
+
+		if (!sealed.empty())
+			recovery._last_timestamp = sealed.back()._timestamp;
+	}
+
+	auto index_fd = open(segment._index_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (index_fd < 0)
+	{
+		recovery._ok = false;
+		return recovery;
+	}
+
+	recovery._ok &= write_all(index_fd, index.data(), index.size() * sizeof(log_index_entry)) && fsync(index_fd) == 0;
+	close(index_fd);
+	return recovery;
+}
+
+segmented_log::segmented_log(const char* dir, const log_segment_options& options, std::uint64_t next_sequence, std::uint64_t last_timestamp) :
+	_dir(dir), _options(options), _next_sequence(next_sequence), _written_sequence(next_sequence), _last_timestamp(last_timestamp)
+{
+	mkdir(dir, 0755);
+
+	auto segments = list_log_segments(dir);
+	this->open_segment(segments.empty() ? make_segment(this->_dir, next_sequence) : segments.back());
+}
+
+segmented_log::~segmented_log()
+{
+	this->flush();
+	this->close_segment();
+}
+
+bool spliced_record::add_stored(std::uint64_t payload_offset, std::size_t length)
+{
+	auto at = this->_header_at + sizeof(log_record_header) + payload_offset;
+	auto page = at & ~(std::uint64_t)4095;
+	auto delta = at - page;
+	auto data = mmap(nullptr, delta + length, PROT_READ, MAP_SHARED, this->_fd, page);
+
+	if (data == MAP_FAILED)
+		return false;
+
+	this->_crc = crc32c((const char*)data + delta, length, this->_crc);
+	munmap(data, delta + length);
+	return true;
+}
+
+void spliced_record::close()
+{
+	if (this->_fd >= 0)
+		::close(this->_fd);
+
+	this->_fd = -1;
+}
+
+// Appends to the segment where it left off. The space for the rest of the segment is allocated
+// up front without changing the file size, so readers and recovery still see only records.
+bool segmented_log::open_segment(const log_segment& segment)
+{
+	// readable for the CRC of spliced payloads
+	this->_fd = open(segment._path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	this->_index_fd = open(segment._index_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+	if (this->_fd < 0 || this->_index_fd < 0)
+	{
+		this->close_segment();
+		return false;
+	}
+
+	struct stat st;
+	fstat(this->_fd, &st);
+	this->_segment_size = this->_written = st.st_size;
+
+	if (this->_segment_size < this->_options._segment_bytes)
+		fallocate(this->_fd, FALLOC_FL_KEEP_SIZE, this->_segment_size, this->_options._segment_bytes - this->_segment_size);
+
+	if (this->_segment_size == 0)
+		sync_dir(this->_dir);
+
+	return true;
+}
+
+void segmented_log::close_segment()
+{
+	if (this->_fd >= 0)
+		close(this->_fd);
+
+	if (this->_index_fd >= 0)
+		close(this->_index_fd);
+
+	this->_fd = this->_index_fd = -1;
+}
+
+// Removes the oldest sealed segments while the log is over its size, or they are over their age
+void segmented_log::apply_retention()
+{
+	auto& options = this->_options;
+
+	if (options._retain_bytes == 0 && options._retain_seconds == 0)
+		return;
+
+	auto segments = list_log_segments(this->_dir.c_str());
+
+	std::vector<struct stat> stats(segments.size());
+	std::uint64_t total = 0;
+
+	for (std::size_t i = 0; i < segments.size(); i++)
+	{
+		if (stat(segments[i]._path.c_str(), &stats[i]) != 0)
+			stats[i] = {};
+
+		total += stats[i].st_size;
+	}
+
+	auto now = std::time(nullptr);
+	bool removed = false;
+
+	for (std::size_t i = 0; i + 1 < segments.size(); i++)
+	{
+		auto over_size = options._retain_bytes != 0 && total > options._retain_bytes;
+		auto over_age = options._retain_seconds != 0 && now - stats[i].st_mtime > (std::time_t)options._retain_seconds;
+
+		if (!over_size && !over_age)
+			break;
+
+		unlink(segments[i]._path.c_str());
+		unlink(segments[i]._index_path.c_str());
+		total -= stats[i].st_size;
+		removed = true;
+	}
+
+	if (removed)
+		sync_dir(this->_dir);
+}
+
+// Starts the next segment first when the record does not fit this one, then numbers the record
+log_record_header segmented_log::next_header(std::uint64_t connection, std::size_t length)
+{
+	auto record_size = sizeof(log_record_header) + length;
+
+	// the sealed segment is synced with its index before the next one starts, a failed flush has
+	// taken back the numbers of its batch by then
+	if (this->_segment_size != 0 && this->_segment_size + record_size > this->_options._segment_bytes)
+	{
+		this->sync();
+		this->close_segment();
+		this->open_segment(make_segment(this->_dir, this->_next_sequence));
+		this->apply_retention();
+	}
+
+	log_record_header header;
+	header._crc = 0;
+	header._length = (std::uint32_t)length;
+	header._timestamp = this->_last_timestamp = std::max(realtime_ns(), this->_last_timestamp + 1);
+	header._connection = connection;
+	header._sequence = this->_next_sequence++;
+
+	if (is_indexed(header, this->_segment_size, this->_options._index_interval))
+		this->_index_batch.push_back({ header._timestamp, header._sequence, this->_segment_size });
+
+	this->_segment_size += record_size;
+	return header;
+}
+
+void segmented_log::append(std::uint64_t connection, const char* data, std::size_t length)
+{
+	auto header = this->next_header(connection, length);
+	header._crc = log_record_crc(header, data);
+
+	auto& batch = this->_batch;
+	batch.insert(batch.end(), (const char*)&header, (const char*)&header + sizeof(header));
+	batch.insert(batch.end(), data, data + length);
+}
+
+bool segmented_log::begin_spliced(std::uint64_t connection, std::size_t length, spliced_record& record)
+{
+	auto header = this->next_header(connection, length);
+	header._crc = log_placeholder_crc(header);
+
+	auto& batch = this->_batch;
+	batch.insert(batch.end(), (const char*)&header, (const char*)&header + sizeof(header));
+
+	if (!this->flush())
+		return false;
+
+	auto header_at = this->_segment_size - length - sizeof(header);
+
+	// the payload's room reads back as zeros until it is stored, without it the placeholder is
+	// taken back like a failed flush
+	record._fd = ftruncate(this->_fd, this->_segment_size) == 0 ? fcntl(this->_fd, F_DUPFD_CLOEXEC, 0) : -1;
+
+	if (record._fd < 0)
+	{
+		ftruncate(this->_fd, header_at);
+		this->_segment_size = this->_written = header_at;
+		this->_next_sequence = this->_written_sequence = header._sequence;
+		return false;
+	}
+
+	record._header_at = header_at;
+	record._header = header;
+	record._crc = log_record_header_crc(header);
+	return true;
+}
+
+// Records before index entries, so an entry never points past what was written. Part of a batch
+// that failed may have reached the file, it is cut off again; the index entries of the batch are
+// dropped with it. A failed index write leaves the records in place, reads only lose a shortcut.
+bool segmented_log::flush()
+{
+	auto& batch = this->_batch;
+	auto& index_batch = this->_index_batch;
+
+	if (!batch.empty() && !write_all_at(this->_fd, batch.data(), batch.size(), this->_written))
+	{
+		ftruncate(this->_fd, this->_written);
+		this->_segment_size = this->_written;
+		this->_next_sequence = this->_written_sequence;
+		batch.clear();
+		index_batch.clear();
+		return false;
+	}
+
+	this->_written = this->_segment_size;
+	this->_written_sequence = this->_next_sequence;
+	batch.clear();
+
+	auto complete = index_batch.empty() || write_all(this->_index_fd, index_batch.data(), index_batch.size() * sizeof(log_index_entry));
+	index_batch.clear();
+	return complete;
+}
+
+bool segmented_log::sync()
+{
+	return this->flush() && fdatasync(this->_fd) == 0 && fdatasync(this->_index_fd) == 0;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "log_record.hpp"
+#include "log_recovery.hpp"
+
+// A binary message log kept as a directory of fixed-size segments. A segment is named after the
+// sequence of its first record, <sequence>.log holds the records and <sequence>.idx a sparse
+// index of them: the first record of the segment and every record whose sequence is a multiple
+// of the index interval. Only the newest segment is appended to; the older ones are sealed and
+// only ever deleted whole by retention.
+
+struct log_index_entry
+{
+	std::uint64_t _timestamp;
+	std::uint64_t _sequence;
+	// of the record inside its segment
+	std::uint64_t _offset;
+};
+
+static_assert(sizeof(log_index_entry) == 24);
+
+struct log_segment_options
+{
+	std::uint64_t _segment_bytes = 64ull << 20;
+	std::uint32_t _index_interval = 256;
+	// retention, 0 keeps everything; the newest segment is never removed
+	std::uint64_t _retain_bytes = 0;
+	std::uint32_t _retain_seconds = 0;
+};
+
+struct log_segment
+{
+	std::uint64_t _first_sequence;
+	std::string _path;
+	std::string _index_path;
+};
+
+// The segments of the log directory, oldest first
+std::vector<log_segment> list_log_segments(const char* dir);
+
+// Index entries of a segment, in sequence order. A torn last entry is left out.
+std::vector<log_index_entry> read_log_index(const char* path);
+
+// Part of a segment a replay reads, the descriptor keeps it readable after retention removed it
+struct log_span
+{
+	int _fd;
+	std::uint64_t _offset;
+	std::uint64_t _length;
+};
+
+// Opens the records from from_sequence on up to what is written so far, the first span starts
+// at that record. Sequences older than the oldest segment start the spans at its beginning.
+std::vector<log_span> open_log_spans(const char* dir, std::uint64_t from_sequence);
+
+// Deletes every segment and index of the directory, the directory itself stays
+void remove_log_segments(const char* dir);
+
+// Recovers the newest segment like recover_record_log and rebuilds its index, which may miss
+// the records of the last flush. Sealed segments are complete and left alone. _records and
+// the byte counts are for the newest segment; when it holds no record yet, _last_timestamp is
+// the last indexed one of the segment before.
+log_recovery recover_segmented_log(const char* dir, std::uint32_t index_interval);
+
+// A record whose payload the caller moves into the segment itself, from _header_at +
+// sizeof(log_record_header) on, see segmented_log::begin_spliced
+struct spliced_record
+{
+	// a descriptor of the segment of its own, it outlives the log moving on to the next segment
+	int _fd = -1;
+	std::uint64_t _header_at = 0;
+	// the final header once complete() ran, the placeholder's fields until then
+	log_record_header _header{};
+	// over the header fields and the payload stored so far
+	std::uint32_t _crc = 0;
+
+	// Continues the CRC over the next length payload bytes, just stored at payload_offset. They
+	// are read back through a mapping, the one pass over the payload that is left in userspace;
+	// right after the store the part is still in the CPU cache, so it does not go out to memory
+	// a second time. False when the mapping failed.
+	bool add_stored(std::uint64_t payload_offset, std::size_t length);
+
+	// Sets the header's CRC, the header is then written over the placeholder
+	inline void complete() { this->_header._crc = this->_crc; }
+
+	void close();
+};
+
+// Appends records to the newest segment. append() only encodes into the batch, flush() hands it
+// to one write (two with index entries), so a loop iteration costs a single syscall however many
+// messages it persisted. A record that does not fit the segment any more seals it and starts the
+// next one, preallocated with fallocate so its writes stay sequential on disk.
+// Records are written at the offset the log keeps rather than appended, splice refuses files
+// opened with O_APPEND.
+class segmented_log
+{
+	std::string _dir;
+	log_segment_options _options;
+	int _fd = -1;
+	int _index_fd = -1;
+	// bytes of the open segment, the batch included, and the part of them already written
+	std::uint64_t _segment_size = 0;
+	std::uint64_t _written = 0;
+	// the sequence of the next record and that of the first one not written yet
+	std::uint64_t _next_sequence;
+	std::uint64_t _written_sequence;
+	std::uint64_t _last_timestamp;
+	std::vector<char> _batch;
+	std::vector<log_index_entry> _index_batch;
+
+	log_record_header next_header(std::uint64_t connection, std::size_t length);
+	bool open_segment(const log_segment& segment);
+	void close_segment();
+	void apply_retention();
+public:
+	segmented_log(const char* dir, const log_segment_options& options, std::uint64_t next_sequence, std::uint64_t last_timestamp = 0);
+	segmented_log(const segmented_log&) = delete;
+	~segmented_log();
+
+	inline bool is_open() const { return this->_fd >= 0; }
+	inline const std::string& dir() const { return this->_dir; }
+
+	void append(std::uint64_t connection, const char* data, std::size_t length);
+
+	// Starts a record of length payload bytes that the caller stores into record._fd itself, e.g.
+	// spliced from a socket, so they never pass through userspace. The batch is written up to a
+	// placeholder header at once and the file is extended over the payload's room, so records
+	// appended meanwhile go behind it. Once the whole payload is stored, the caller writes
+	// record._header over the placeholder. False when the log could not be written.
+	bool begin_spliced(std::uint64_t connection, std::size_t length, spliced_record& record);
+
+	// Writes the batch. When that fails the log goes back to the end of the last record written,
+	// the batch is dropped and its sequence numbers are handed out again, so no hole is left for
+	// the next batch to be written behind.
+	bool flush();
+	bool sync();
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+class ip_sock {
+	int sock;
+public:
+	ip_sock() { this->sock = socket(AF_INET, SOCK_STREAM, 0); }
+	explicit ip_sock(int sock) { this->sock = sock; }
+	~ip_sock() { close(this->sock); }
+
+	inline auto& get_sock() { return this->sock; }
+	inline operator int() { return this->get_sock(); }
+	inline operator bool() { return (bool)this->get_sock(); }
+};
@@ -0,0 +1,103 @@
+#include "placement.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+std::vector<int> parse_cpu_list(const char* list)
+{
+	std::vector<int> cpus;
+
+	while (*list != '\0')
+	{
+		char* end;
+		auto first = std::strtol(list, &end, 10);
+
+		if (end == list || first < 0)
+			return {};
+
+		auto last = first;
+
+		if (*end == '-')
+		{
+			list = end + 1;
+			last = std::strtol(list, &end, 10);
+
+			if (end == list || last < first)
+				return {};
+		}
+
+		for (auto cpu = first; cpu <= last; cpu++)
+			cpus.push_back((int)cpu);
+
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return {};
+
+		list = end;
+	}
+
+	return cpus;
+}
+
+int pin_current_thread(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+int cpu_numa_node(int cpu)
+{
+	char path[64];
+	std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+	auto dir = opendir(path);
+
+	if (dir == nullptr)
+		return 0;
+
+	auto node = 0;
+
+	while (auto entry = readdir(dir))
+	{
+		if (std::strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+		{
+			node = std::atoi(entry->d_name + 4);
+			break;
+		}
+	}
+
+	closedir(dir);
+	return node;
+}
+
+int bind_to_node(void* addr, std::size_t length, int node)
+{
+	if (node < 0 || node >= 64)
+		return EINVAL;
+
+	auto page = (std::uintptr_t)sysconf(_SC_PAGESIZE);
+	auto begin = ((std::uintptr_t)addr + page - 1) & ~(page - 1);
+	auto end = ((std::uintptr_t)addr + length) & ~(page - 1);
+
+	if (end <= begin)
+		return 0;
+
+	unsigned long mask = 1ul << node;
+
+	if (syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0) != 0)
+		return errno;
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// "0-3,8,10-11" -> { 0, 1, 2, 3, 8, 10, 11 }, empty when the list is malformed
+std::vector<int> parse_cpu_list(const char* list);
+
+// Restricts the calling thread to one CPU, returns 0 or an errno value
+int pin_current_thread(int cpu);
+
+// NUMA node the CPU belongs to, 0 on machines that expose no NUMA topology
+int cpu_numa_node(int cpu);
+
+// Places the not yet faulted pages of [addr, addr + length) on node, preferring it rather than
+// failing when the node runs out. The range is shrunk to whole pages. Returns 0 or an errno value
+int bind_to_node(void* addr, std::size_t length, int node);
@@ -0,0 +1,112 @@
+#include "ring_loop.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <vector>
+#include <chrono>
+
+#include "tsc.hpp"
+
+io_uring_sqe* acquire_sqe(io_uring& ioring)
+{
+	auto sqe = io_uring_get_sqe(&ioring);
+
+	if (sqe == nullptr)
+	{
+		io_uring_submit(&ioring);
+		sqe = io_uring_get_sqe(&ioring);
+	}
+
+	if (sqe == nullptr) {
+		std::printf("Fatal error acquire sqe\n");
+		raise(SIGTRAP);
+	}
+
+	return sqe;
+}
+
+ring_loop::~ring_loop()
+{
+	if (this->_initialized)
+		io_uring_queue_exit(&this->_ring);
+}
+
+int ring_loop::init(unsigned entries, unsigned flags)
+{
+	auto ret = io_uring_queue_init(entries, &this->_ring, flags);
+	this->_initialized = ret >= 0;
+	return ret;
+}
+
+void ring_loop::submit()
+{
+	if (io_uring_sq_ready(&this->_ring) == 0)
+		return;
+
+	io_uring_submit(&this->_ring);
+	this->_stats._submits++;
+}
+
+int ring_loop::wait_cqe(io_uring_cqe** cqe)
+{
+	// a completion that is already there took no waiting either way
+	if (io_uring_peek_cqe(&this->_ring, cqe) == 0)
+		return 0;
+
+	if (this->_spin_budget.count() != 0)
+	{
+		auto spin_end = tsc_clock::now() + this->_spin_budget;
+		auto batch = pauses_per_us();
+
+		do
+		{
+			for (std::uint32_t i = 0; i < batch; i++)
+				cpu_relax();
+
+			if (io_uring_peek_cqe(&this->_ring, cqe) == 0)
+			{
+				this->_stats._spin_hits++;
+
+				if (this->_wait._adaptive)
+					this->_spin_budget = std::min(this->_spin_budget * 2, this->_wait._spin);
+
+				return 0;
+			}
+		} while (tsc_clock::now() < spin_end);
+
+		// never below a sixteenth of the configured budget, so a burst after idle is still caught
+		if (this->_wait._adaptive)
+			this->_spin_budget = std::max(this->_spin_budget / 2, this->_wait._spin / 16);
+	}
+
+	this->_stats._sleeps++;
+	return io_uring_wait_cqe(&this->_ring, cqe);
+}
+
+int ring_loop::register_buffers(buffer_pool& pool)
+{
+	std::vector<iovec> iovecs;
+
+	for (std::size_t i = 0; i < pool.region_count(); i++)
+		iovecs.push_back(pool.region_iovec(i));
+
+	auto ret = io_uring_register_buffers(&this->_ring, iovecs.data(), iovecs.size());
+
+	if (ret == 0)
+		pool.set_registered(iovecs.size());
+
+	return ret;
+}
+
+int ring_loop::register_napi([[maybe_unused]] std::uint32_t busy_poll_us, [[maybe_unused]] bool prefer_busy_poll)
+{
+#if defined(IO_URING_VERSION_MAJOR) && (IO_URING_VERSION_MAJOR > 2 || (IO_URING_VERSION_MAJOR == 2 && IO_URING_VERSION_MINOR >= 6))
+	io_uring_napi napi{};
+	napi.busy_poll_to = busy_poll_us;
+	napi.prefer_busy_poll = prefer_busy_poll ? 1 : 0;
+	return io_uring_register_napi(&this->_ring, &napi);
+#else
+	return -EOPNOTSUPP;
+#endif
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdio>
+#include <chrono>
+#include <coroutine>
+
+#include <liburing.h>
+
+#include "connection.hpp"
+#include "stats.hpp"
+#include "waiter.hpp"
+
+// The SQ is sized for the common case; when a burst fills it we push what is queued and retry
+io_uring_sqe* acquire_sqe(io_uring& ioring);
+
+// Completions of coroutine awaiters are resumed by the loop itself, the awaiter is the user_data
+struct coro_resumable
+{
+	uring_sock_udata_t _op;
+	std::coroutine_handle<> _handle;
+	int _res;
+};
+
+// Owns the ring and drives it: wait, hand every CQE of the batch to the application,
+// let it flush per-iteration work, then submit everything prepared in one go
+class ring_loop
+{
+	io_uring _ring;
+	loop_stats _stats;
+	wait_policy _wait = wait_policy::power_saving();
+	std::chrono::nanoseconds _spin_budget{ 0 };
+	bool _initialized = false;
+	bool _stopping = false;
+
+	// Polls the CQ for the wait policy's spin window before blocking in the kernel
+	int wait_cqe(io_uring_cqe** cqe);
+public:
+	ring_loop() = default;
+	ring_loop(const ring_loop&) = delete;
+	~ring_loop();
+
+	int init(unsigned entries, unsigned flags = 0);
+
+	inline auto& get() { return this->_ring; }
+	inline auto& stats() { return this->_stats; }
+	inline io_uring_sqe* acquire_sqe() { return ::acquire_sqe(this->_ring); }
+
+	// Submits what is prepared unless count more SQEs fit, so a linked chain goes in one submit
+	inline void reserve_sqes(unsigned count)
+	{
+		if (io_uring_sq_space_left(&this->_ring) < count)
+			io_uring_submit(&this->_ring);
+	}
+	inline void stop() { this->_stopping = true; }
+	inline auto stopping() const { return this->_stopping; }
+
+	inline void set_wait_policy(wait_policy policy)
+	{
+		this->_wait = policy;
+		this->_spin_budget = policy._spin;
+	}
+
+	// Registers every region of the pool as a fixed buffer, READ_FIXED then skips the per-op page pinning
+	int register_buffers(buffer_pool& pool);
+
+	// Lets the kernel busy-poll the NAPI contexts of the ring's sockets, needs liburing 2.6 and Linux 6.9
+	int register_napi(std::uint32_t busy_poll_us, bool prefer_busy_poll);
+
+	void submit();
+
+	template <class cqe_fn, class iteration_fn>
+	void run(cqe_fn&& on_cqe, iteration_fn&& on_iteration)
+	{
+		while (!this->_stopping)
+		{
+			io_uring_cqe* cqe_arr[256];
+
+			if (this->wait_cqe(&cqe_arr[0]) < 0)
+				continue;
+
+			auto cqe_num = io_uring_peek_batch_cqe(&this->_ring, cqe_arr, sizeof(cqe_arr) / sizeof(cqe_arr[0]));
+			this->_stats.record_batch(cqe_num);
+
+			for (unsigned i = 0; i < cqe_num; i++)
+			{
+				auto cqe = cqe_arr[i];
+				auto ud = (uring_sock_udata_t*)io_uring_cqe_get_data(cqe);
+
+				if (ud == nullptr)
+				{
+					io_uring_cqe_seen(&this->_ring, cqe);
+					continue;
+				}
+
+				if (ud->_ucmd == uring_sock_udata_t::COROUTINE)
+				{
+					// resuming may destroy the frame holding ud, so it is not touched afterwards
+					auto resumable = (coro_resumable*)ud;
+					resumable->_res = cqe->res;
+					io_uring_cqe_seen(&this->_ring, cqe);
+					resumable->_handle.resume();
+					continue;
+				}
+
+				on_cqe(cqe, ud);
+				io_uring_cqe_seen(&this->_ring, cqe);
+			}
+
+			on_iteration();
+			this->submit();
+		}
+	}
+};
@@ -0,0 +1,51 @@
+#include "shutdown.hpp"
+
+#include <csignal>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+
+shutdown_signal::~shutdown_signal()
+{
+	if (this->_signal_fd >= 0)
+		close(this->_signal_fd);
+
+	if (this->_event_fd >= 0)
+		close(this->_event_fd);
+}
+
+bool shutdown_signal::open()
+{
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+
+	if (pthread_sigmask(SIG_BLOCK, &signals, nullptr) != 0)
+		return false;
+
+	this->_signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+	this->_event_fd = eventfd(0, EFD_CLOEXEC);
+
+	if (this->_signal_fd >= 0 && this->_event_fd >= 0)
+		return true;
+
+	// without the fds the default actions have to stay in place
+	pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+
+	if (this->_signal_fd >= 0)
+		close(this->_signal_fd);
+
+	if (this->_event_fd >= 0)
+		close(this->_event_fd);
+
+	this->_signal_fd = this->_event_fd = -1;
+	return false;
+}
+
+void shutdown_signal::raise()
+{
+	std::uint64_t one = 1;
+	write(this->_event_fd, &one, sizeof(one));
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// SIGTERM and SIGINT taken from a signalfd read on a ring instead of a handler. open() blocks
+// both signals, so it has to run before any thread is spawned for every thread to inherit the
+// mask. The ring that reads the signal raise()s the eventfd the other rings poll.
+class shutdown_signal
+{
+	int _signal_fd = -1;
+	int _event_fd = -1;
+public:
+	shutdown_signal() = default;
+	shutdown_signal(const shutdown_signal&) = delete;
+	~shutdown_signal();
+
+	bool open();
+
+	inline int signal_fd() const { return this->_signal_fd; }
+	inline int event_fd() const { return this->_event_fd; }
+
+	// Makes event_fd readable for good, so every poll armed on it completes
+	void raise();
+};
@@ -0,0 +1,47 @@
+#include "stats.hpp"
+
+void loop_stats::dump(std::FILE* out) const
+{
+	std::fprintf(out, "loop: iterations %llu cqes %llu submits %llu max batch %llu avg batch %.2f spin hits %llu sleeps %llu\n",
+		(unsigned long long)this->_iterations, (unsigned long long)this->_cqes, (unsigned long long)this->_submits,
+		(unsigned long long)this->_max_batch, this->_iterations ? (double)this->_cqes / this->_iterations : 0.0,
+		(unsigned long long)this->_spin_hits, (unsigned long long)this->_sleeps);
+}
+
+std::uint64_t latency_histogram::percentile(double p) const
+{
+	if (this->_count == 0)
+		return 0;
+
+	auto target = (std::uint64_t)(p * this->_count);
+	std::uint64_t seen = 0;
+
+	for (int i = 0; i < BUCKETS; i++)
+	{
+		seen += this->_buckets[i];
+
+		if (seen > target)
+			return i == 0 ? 0 : (i == 64 ? UINT64_MAX : (1ull << i) - 1);
+	}
+
+	return this->_max;
+}
+
+void latency_histogram::dump(std::FILE* out, const char* name) const
+{
+	if (this->_count == 0)
+	{
+		std::fprintf(out, "%s: no samples\n", name);
+		return;
+	}
+
+	std::fprintf(out, "%s: count %llu min %llu avg %llu p50 <%llu p99 <%llu p999 <%llu max %llu ns\n", name,
+		(unsigned long long)this->_count, (unsigned long long)this->_min, (unsigned long long)(this->_sum / this->_count),
+		(unsigned long long)this->percentile(0.5), (unsigned long long)this->percentile(0.99), (unsigned long long)this->percentile(0.999),
+		(unsigned long long)this->_max);
+}
+
+void latency_histogram::reset()
+{
+	*this = latency_histogram{};
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+// Counters kept by the ring loop, cheap enough to update on every iteration
+struct loop_stats
+{
+	std::uint64_t _iterations = 0;
+	std::uint64_t _cqes = 0;
+	std::uint64_t _submits = 0;
+	std::uint64_t _max_batch = 0;
+	// waits that found a completion while polling the CQ, and waits that blocked in the kernel
+	std::uint64_t _spin_hits = 0;
+	std::uint64_t _sleeps = 0;
+
+	inline void record_batch(std::uint64_t cqes)
+	{
+		this->_iterations++;
+		this->_cqes += cqes;
+
+		if (cqes > this->_max_batch)
+			this->_max_batch = cqes;
+	}
+
+	void dump(std::FILE* out) const;
+};
+
+// Power of two bucketed latency histogram, percentiles are reported as the bucket upper bound
+class latency_histogram
+{
+	static constexpr int BUCKETS = 65;
+
+	std::uint64_t _buckets[BUCKETS]{};
+	std::uint64_t _count = 0;
+	std::uint64_t _sum = 0;
+	std::uint64_t _min = UINT64_MAX;
+	std::uint64_t _max = 0;
+public:
+	inline void record(std::uint64_t ns)
+	{
+		this->_buckets[ns == 0 ? 0 : 64 - __builtin_clzll(ns)]++;
+		this->_count++;
+		this->_sum += ns;
+
+		if (ns < this->_min)
+			this->_min = ns;
+		if (ns > this->_max)
+			this->_max = ns;
+	}
+
+	inline auto count() const { return this->_count; }
+
+	std::uint64_t percentile(double p) const;
+	void dump(std::FILE* out, const char* name) const;
+	void reset();
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <chrono>
+#include <linux/time_types.h>
+
+template <class rep, class per>
+class c2kts
+{
+	__kernel_timespec _kts;
+public:
+	constexpr c2kts(const std::chrono::duration<rep, per>&& t) : _kts{}
+	{
+		auto sec = std::chrono::duration_cast<std::chrono::seconds>(t);
+		_kts = { sec.count(), std::chrono::duration_cast<std::chrono::nanoseconds>(t - sec).count() };
+	}
+
+	auto* get_kts()
+	{
+		return &this->_kts;
+	}
+};
+#define chrono_to_timespec(t) [](){ constexpr c2kts obj(t); return obj; }().get_kts()
+
+// Runtime counterpart of chrono_to_timespec for durations only known after startup
+template <class rep, class per>
+inline __kernel_timespec to_kts(std::chrono::duration<rep, per> t)
+{
+	return *c2kts(std::move(t)).get_kts();
+}
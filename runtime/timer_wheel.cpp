@@ -0,0 +1,47 @@
+#include "timer_wheel.hpp"
+
+timer_wheel::timer_wheel(std::size_t slots)
+{
+	std::size_t size = 1;
+
+	while (size < slots)
+		size <<= 1;
+
+	this->_slots.resize(size);
+
+	for (auto& head : this->_slots)
+		head._prev = head._next = &head;
+}
+
+void timer_wheel::unlink(wheel_entry* entry)
+{
+	entry->_prev->_next = entry->_next;
+	entry->_next->_prev = entry->_prev;
+	entry->_prev = entry->_next = nullptr;
+}
+
+void timer_wheel::link_before(wheel_entry* head, wheel_entry* entry)
+{
+	entry->_prev = head->_prev;
+	entry->_next = head;
+	head->_prev->_next = entry;
+	head->_prev = entry;
+}
+
+void timer_wheel::schedule(wheel_entry* entry, std::uint64_t expires)
+{
+	if (entry->linked())
+		unlink(entry);
+
+	if (expires <= this->_now)
+		expires = this->_now + 1;
+
+	entry->_expires = expires;
+	link_before(&this->_slots[expires & (this->_slots.size() - 1)], entry);
+}
+
+void timer_wheel::cancel(wheel_entry* entry)
+{
+	if (entry->linked())
+		unlink(entry);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Intrusive link of an object waiting in a timer_wheel, unlinked while _prev is null.
+// _owner points back at the object the entry is embedded in.
+struct wheel_entry
+{
+	wheel_entry* _prev = nullptr;
+	wheel_entry* _next = nullptr;
+	std::uint64_t _expires = 0;
+	void* _owner = nullptr;
+
+	inline bool linked() const { return this->_prev != nullptr; }
+};
+
+// Hashed timing wheel: one list per slot, an entry sits in the slot of its expiry tick and is
+// skipped until the wheel went around often enough. Scheduling and cancelling are O(1), so it can
+// hold a deadline for every connection while the ring only arms one timeout per tick.
+class timer_wheel
+{
+	std::vector<wheel_entry> _slots;
+	std::uint64_t _now = 0;
+
+	static void unlink(wheel_entry* entry);
+	static void link_before(wheel_entry* head, wheel_entry* entry);
+public:
+	// slots is rounded up to a power of two
+	timer_wheel(std::size_t slots);
+	timer_wheel(const timer_wheel&) = delete;
+
+	inline auto now() const { return this->_now; }
+
+	// Expires the entry at tick expires, at the next tick when that is not in the future
+	void schedule(wheel_entry* entry, std::uint64_t expires);
+
+	void cancel(wheel_entry* entry);
+
+	// Moves the wheel one tick ahead and hands every entry due by then to on_expired, unlinked.
+	// They are taken out of the slot first, so on_expired may schedule or cancel any entry.
+	template <class fn>
+	void advance(fn&& on_expired)
+	{
+		this->_now++;
+
+		auto& head = this->_slots[this->_now & (this->_slots.size() - 1)];
+		wheel_entry expired;
+		expired._prev = expired._next = &expired;
+
+		for (auto entry = head._next; entry != &head;)
+		{
+			auto next = entry->_next;
+
+			if (entry->_expires <= this->_now)
+			{
+				unlink(entry);
+				link_before(&expired, entry);
+			}
+
+			entry = next;
+		}
+
+		while (expired._next != &expired)
+		{
+			auto entry = expired._next;
+			unlink(entry);
+			on_expired(entry);
+		}
+	}
+};
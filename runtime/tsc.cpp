@@ -0,0 +1,65 @@
+#include "tsc.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+// Invariant TSC: constant rate across P/C-states (CPUID 0x80000007 EDX bit 8)
+static bool cpu_has_invariant_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned eax, ebx, ecx, edx;
+
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0)
+		return false;
+
+	return (edx & (1u << 8)) != 0;
+#else
+	return false;
+#endif
+}
+
+// The kernel drops tsc as clocksource when it sees it unsynchronized between cores
+static bool kernel_trusts_tsc()
+{
+	std::ifstream source("/sys/devices/system/clocksource/clocksource0/current_clocksource");
+	std::string name;
+	source >> name;
+	return name == "tsc";
+}
+
+tsc_clock::calibration tsc_clock::calibrate()
+{
+	calibration c{ false, 0, 0, 0 };
+
+	if (!cpu_has_invariant_tsc() || !kernel_trusts_tsc())
+		return c;
+
+	auto ns_start = monotonic_ns();
+	auto tsc_start = ticks();
+
+	timespec pause{ 0, 10 * 1000 * 1000 };
+	nanosleep(&pause, nullptr);
+
+	auto ns_end = monotonic_ns();
+	auto tsc_end = ticks();
+
+	if (tsc_end <= tsc_start || ns_end <= ns_start)
+		return c;
+
+	c._use_tsc = true;
+	c._tsc_base = tsc_end;
+	c._ns_base = ns_end;
+	c._mult = (std::uint64_t)(((unsigned __int128)(ns_end - ns_start) << 32) / (tsc_end - tsc_start));
+	return c;
+}
+
+double tsc_clock::ticks_per_ns()
+{
+	auto& c = calibrated();
+	return c._use_tsc ? 4294967296.0 / c._mult : 0.0;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Monotonic nanosecond clock read from the invariant TSC and scaled with a factor calibrated
+// against CLOCK_MONOTONIC at startup. When the CPU has no invariant TSC or the kernel does not
+// use it as clocksource, now() reads CLOCK_MONOTONIC instead.
+class tsc_clock
+{
+public:
+	using rep = std::int64_t;
+	using period = std::nano;
+	using duration = std::chrono::nanoseconds;
+	using time_point = std::chrono::time_point<tsc_clock>;
+	static constexpr bool is_steady = true;
+
+	struct calibration
+	{
+		bool _use_tsc;
+		std::uint64_t _tsc_base;
+		std::int64_t _ns_base;
+		// ns = (ticks * _mult) >> 32
+		std::uint64_t _mult;
+	};
+
+	static const calibration& calibrated()
+	{
+		static const calibration c = calibrate();
+		return c;
+	}
+
+	static inline std::uint64_t ticks()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return 0;
+#endif
+	}
+
+	static inline std::int64_t monotonic_ns()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (std::int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+	static inline time_point now()
+	{
+		auto& c = calibrated();
+
+		if (!c._use_tsc)
+			return time_point(duration(monotonic_ns()));
+
+		auto elapsed = (std::int64_t)(((unsigned __int128)(ticks() - c._tsc_base) * c._mult) >> 32);
+		return time_point(duration(c._ns_base + elapsed));
+	}
+
+	static inline auto uses_tsc() { return calibrated()._use_tsc; }
+
+	// TSC ticks per nanosecond, 0 on the CLOCK_MONOTONIC fallback
+	static double ticks_per_ns();
+private:
+	static calibration calibrate();
+};
+
+// Nanoseconds elapsed since start, for feeding latency_histogram
+inline std::uint64_t elapsed_ns(tsc_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(tsc_clock::now() - start).count();
+}
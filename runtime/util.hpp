@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+
+template <class type, std::size_t size>
+class to_string
+{
+	type buf[size];
+public:
+	template <class... args>
+	to_string(const type* s, args&&... arg) { sprintf(this->buf, s, arg...); }
+
+	inline auto get() { return this->buf; }
+	inline operator type*() { return this->get(); }
+};
+
+template <std::size_t size>
+using to_ch_string = to_string<char, size>;
@@ -0,0 +1,102 @@
+#include "waiter.hpp"
+#include "tsc.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+std::uint32_t pauses_per_us()
+{
+	static const auto calibrated = []()
+	{
+		constexpr std::uint32_t SAMPLE = 10000;
+
+		auto start = tsc_clock::now();
+		for (std::uint32_t i = 0; i < SAMPLE; i++)
+			cpu_relax();
+		auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(tsc_clock::now() - start).count();
+
+		auto per_us = elapsed > 0 ? SAMPLE * 1000ull / elapsed : SAMPLE;
+		return (std::uint32_t)(per_us == 0 ? 1 : per_us);
+	}();
+
+	return calibrated;
+}
+
+bool wait_policy::parse(const char* name, wait_policy& policy)
+{
+	if (std::strcmp(name, "low-latency") == 0)
+		policy = low_latency();
+	else if (std::strcmp(name, "power-saving") == 0)
+		policy = power_saving();
+	else
+		return false;
+
+	return true;
+}
+
+bool hybrid_waiter::wait_for(std::chrono::nanoseconds timeout)
+{
+	using clock = tsc_clock;
+
+	auto seen = this->_word.load(std::memory_order_acquire);
+	auto start = clock::now();
+	auto deadline = start + timeout;
+
+	if (this->_policy._spin.count() != 0)
+	{
+		auto spin_end = start + std::min(timeout, this->_policy._spin);
+		auto batch = pauses_per_us();
+
+		do
+		{
+			for (std::uint32_t i = 0; i < batch; i++)
+			{
+				if (this->_word.load(std::memory_order_acquire) != seen)
+				{
+					this->_spin_wakeups++;
+					return true;
+				}
+
+				cpu_relax();
+			}
+		} while (clock::now() < spin_end);
+	}
+
+	while (true)
+	{
+		auto now = clock::now();
+
+		if (now >= deadline)
+		{
+			this->_timeouts++;
+			return false;
+		}
+
+		auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now).count();
+		timespec ts{ (time_t)(left / 1000000000), (long)(left % 1000000000) };
+
+		this->_parked.fetch_add(1, std::memory_order_seq_cst);
+		syscall(SYS_futex, (std::uint32_t*)&this->_word, FUTEX_WAIT_PRIVATE, seen, &ts, nullptr, 0);
+		this->_parked.fetch_sub(1, std::memory_order_relaxed);
+
+		// EAGAIN, EINTR and spurious returns all end up re-checking the word and the deadline
+		if (this->_word.load(std::memory_order_acquire) != seen)
+		{
+			this->_park_wakeups++;
+			return true;
+		}
+	}
+}
+
+void hybrid_waiter::notify()
+{
+	this->_word.fetch_add(1, std::memory_order_seq_cst);
+
+	if (this->_parked.load(std::memory_order_seq_cst) != 0)
+		syscall(SYS_futex, (std::uint32_t*)&this->_word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield" ::: "memory");
+#endif
+}
+
+// pause iterations taking about a microsecond on this CPU, measured on first use
+std::uint32_t pauses_per_us();
+
+// How long a wait polls before it blocks. low_latency burns a core for a short window to catch
+// events arriving right after the wait started, power_saving blocks right away. An adaptive
+// policy treats _spin as the upper bound and lets the ring loop shrink the window while spins
+// keep ending in a sleep.
+struct wait_policy
+{
+	std::chrono::nanoseconds _spin;
+	bool _adaptive = false;
+
+	static constexpr wait_policy low_latency() { return { std::chrono::microseconds(50) }; }
+	static constexpr wait_policy power_saving() { return { std::chrono::nanoseconds(0) }; }
+	static constexpr wait_policy busy_poll(std::chrono::microseconds spin) { return { spin, true }; }
+
+	// "low-latency" or "power-saving"
+	static bool parse(const char* name, wait_policy& policy);
+};
+
+// Spins on a counter for the policy's window, then parks on it in futex until notify() or the timeout
+class hybrid_waiter
+{
+	std::atomic<std::uint32_t> _word{ 0 };
+	std::atomic<std::uint32_t> _parked{ 0 };
+	wait_policy _policy;
+public:
+	std::uint64_t _spin_wakeups = 0;
+	std::uint64_t _park_wakeups = 0;
+	std::uint64_t _timeouts = 0;
+
+	hybrid_waiter(wait_policy policy = wait_policy::power_saving()) : _policy(policy) {}
+
+	// Returns true when woken by notify(), false once the timeout expired
+	bool wait_for(std::chrono::nanoseconds timeout);
+
+	void notify();
+};
@@ -0,0 +1,60 @@
+#include "write_fs.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+void remove_file(const char* filename)
+{
+	std::remove(filename);
+}
+
+write_fs::write_fs(const char* filename, std::ios_base::openmode mode) : _filename(filename)
+{
+	_fs = new std::fstream(filename, mode | std::ios::out);
+	_fs->seekp(0, std::ios::beg);
+}
+
+write_fs::~write_fs()
+{
+	delete this->_fs;
+}
+
+write_fs& write_fs::write_string(const char* string, std::size_t str_length)
+{
+	this->_fs->write(string, str_length == 0 ? strlen(string) : str_length);
+	return *this;
+}
+
+write_fs& write_fs::write(const char* data, std::size_t length)
+{
+	this->_fs->write(data, length);
+	return *this;
+}
+
+write_fs& write_fs::flush()
+{
+	this->_fs->flush();
+	return *this;
+}
+
+// The fstream does not expose its descriptor, any descriptor of the file syncs the same data
+bool write_fs::sync()
+{
+	this->flush();
+
+	auto fd = open(this->_filename.c_str(), O_WRONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+
+	auto ret = fsync(fd);
+	::close(fd);
+	return ret == 0;
+}
+
+void write_fs::close()
+{
+	this->_fs->close();	
+}
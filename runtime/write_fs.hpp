@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+
+void remove_file(const char* filename);
+
+class write_fs
+{
+	std::fstream* _fs;
+	std::string _filename;
+public:
+	write_fs(const char* filename, std::ios_base::openmode mode);
+	~write_fs();
+
+	// A length of 0 takes the string up to its NUL
+	write_fs& write_string(const char* string, std::size_t str_length = 0);
+
+	// Exactly length bytes, none for 0; for messages, which are neither NUL terminated nor non-empty
+	write_fs& write(const char* data, std::size_t length);
+	write_fs& flush();
+
+	// Flushes and waits until the data is on disk, false when fsync failed
+	bool sync();
+	void close();
+};
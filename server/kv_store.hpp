@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include "buffer_pool.hpp"
+
+// Cuts the first space separated token off line, the remainder is left in line
+inline auto next_token(std::string_view& line)
+{
+	auto end = line.find(' ');
+	auto token = line.substr(0, end);
+	line = end == std::string_view::npos ? std::string_view{} : line.substr(end + 1);
+	return token;
+}
+
+// Open-addressing key/value table for the kv mode. Slots are probed linearly and deleted
+// slots become tombstones; key and value bytes sit next to each other in the arena.
+class kv_store
+{
+	static constexpr std::uint32_t EMPTY = 0;
+	static constexpr std::uint32_t TOMBSTONE = 1;
+	static constexpr std::uint32_t USED = 2;
+
+	struct slot
+	{
+		std::uint32_t _state;
+		std::uint32_t _hash;
+		std::uint32_t _key_length;
+		std::uint32_t _value_length;
+		std::uint32_t _value_capacity;
+		char* _data;
+	};
+
+	std::vector<slot> _slots = std::vector<slot>(1024);
+	std::size_t _used = 0;
+	std::size_t _tombstones = 0;
+	byte_arena _arena;
+
+	static auto hash(std::string_view key)
+	{
+		std::uint32_t h = 2166136261u;
+		for (auto c : key)
+			h = (h ^ (std::uint8_t)c) * 16777619u;
+		return h;
+	}
+
+	slot* find(std::string_view key, std::uint32_t h)
+	{
+		auto mask = this->_slots.size() - 1;
+
+		for (auto i = h & mask;; i = (i + 1) & mask)
+		{
+			auto& s = this->_slots[i];
+
+			if (s._state == EMPTY)
+				return nullptr;
+
+			if (s._state == USED && s._hash == h && s._key_length == key.size() && std::memcmp(s._data, key.data(), key.size()) == 0)
+				return &s;
+		}
+	}
+
+	void rehash(std::size_t capacity)
+	{
+		std::vector<slot> slots(capacity);
+		auto mask = capacity - 1;
+
+		for (auto& s : this->_slots)
+		{
+			if (s._state != USED)
+				continue;
+
+			auto i = s._hash & mask;
+			while (slots[i]._state != EMPTY)
+				i = (i + 1) & mask;
+
+			slots[i] = s;
+		}
+
+		this->_slots.swap(slots);
+		this->_tombstones = 0;
+	}
+public:
+	void set(std::string_view key, std::string_view value)
+	{
+		auto h = hash(key);
+
+		if (auto s = this->find(key, h))
+		{
+			if (value.size() > s->_value_capacity)
+			{
+				auto data = this->_arena.allocate(key.size() + value.size());
+				std::memcpy(data, key.data(), key.size());
+				s->_data = data;
+				s->_value_capacity = value.size();
+			}
+
+			std::memcpy(s->_data + key.size(), value.data(), value.size());
+			s->_value_length = value.size();
+			return;
+		}
+
+		if ((this->_used + this->_tombstones + 1) * 2 > this->_slots.size())
+			this->rehash(this->_used * 4 > this->_slots.size() ? this->_slots.size() * 2 : this->_slots.size());
+
+		auto mask = this->_slots.size() - 1;
+		auto i = h & mask;
+		while (this->_slots[i]._state == USED)
+			i = (i + 1) & mask;
+
+		auto& s = this->_slots[i];
+		if (s._state == TOMBSTONE)
+			this->_tombstones--;
+
+		auto data = this->_arena.allocate(key.size() + value.size());
+		std::memcpy(data, key.data(), key.size());
+		std::memcpy(data + key.size(), value.data(), value.size());
+		s = { USED, h, (std::uint32_t)key.size(), (std::uint32_t)value.size(), (std::uint32_t)value.size(), data };
+		this->_used++;
+	}
+
+	bool get(std::string_view key, std::string_view& value)
+	{
+		auto s = this->find(key, hash(key));
+
+		if (s == nullptr)
+			return false;
+
+		value = std::string_view(s->_data + s->_key_length, s->_value_length);
+		return true;
+	}
+
+	bool del(std::string_view key)
+	{
+		auto s = this->find(key, hash(key));
+
+		if (s == nullptr)
+			return false;
+
+		s->_state = TOMBSTONE;
+		this->_used--;
+		this->_tombstones++;
+		return true;
+	}
+
+	inline auto size() const { return this->_used; }
+};
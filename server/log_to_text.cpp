@@ -0,0 +1,102 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log_segment.hpp"
+
+// Prints the messages of a binary message log one per line, the way the text log stores them.
+// The log is a segment directory, converted oldest segment first, or a single segment file.
+// With --with-meta every line starts with the record's timestamp, connection and sequence.
+// A tail that is cut short or fails its CRC is reported on stderr, the log is only read.
+//   server_log_to_text [--with-meta] <log>
+
+static bool convert_segment(const char* path, bool with_meta)
+{
+	auto fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+	{
+		std::fprintf(stderr, "%s: open failed\n", path);
+		return false;
+	}
+
+	struct stat st{};
+	fstat(fd, &st);
+
+	std::size_t length = st.st_size;
+	std::size_t valid = 0;
+
+	if (length != 0)
+	{
+		auto data = (const char*)mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (data == MAP_FAILED)
+		{
+			std::fprintf(stderr, "%s: mmap failed\n", path);
+			close(fd);
+			return false;
+		}
+
+		madvise((void*)data, length, MADV_SEQUENTIAL);
+
+		valid = for_each_log_record(data, length, [&](const log_record_header& header, const char* payload)
+		{
+			// a blob that never completed
+			if (is_log_placeholder(header))
+				return;
+
+			if (with_meta)
+				std::printf("%llu %llu %llu ", (unsigned long long)header._timestamp, (unsigned long long)header._connection, (unsigned long long)header._sequence);
+
+			std::fwrite(payload, 1, header._length, stdout);
+			std::fputc('\n', stdout);
+		});
+
+		munmap((void*)data, length);
+	}
+
+	close(fd);
+
+	if (valid != length)
+	{
+		std::fprintf(stderr, "%s: %zu bytes after offset %zu are torn or corrupted\n", path, length - valid, valid);
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	bool with_meta = false;
+	const char* path = nullptr;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::strcmp(argv[i], "--with-meta") == 0)
+			with_meta = true;
+		else
+			path = argv[i];
+	}
+
+	if (path == nullptr)
+	{
+		std::fprintf(stderr, "usage: %s [--with-meta] <log>\n", argv[0]);
+		return 1;
+	}
+
+	struct stat st{};
+
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+		return convert_segment(path, with_meta) ? 0 : 2;
+
+	bool complete = true;
+
+	for (auto& segment : list_log_segments(path))
+		complete &= convert_segment(segment._path.c_str(), with_meta);
+
+	return complete ? 0 : 2;
+}
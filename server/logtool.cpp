@@ -0,0 +1,377 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "tsc.hpp"
+#include "log_segment.hpp"
+
+// Pulls the messages of a time window, sequence range, connection or substring out of a segmented
+// binary log. The segments are mapped one at a time and only from the index entry in front of
+// the range, so a query reads the part of the log it needs, sequentially, whatever the log's size.
+// Several directories, the shards the workers log to, are merged into one order by timestamp,
+// then worker, then sequence; timestamps strictly increase along a shard, see log_record_header.
+// Sequences are per shard, --from-seq and --to-seq apply to each of them.
+//   server_logtool <log dir>... [--from=<unix s>] [--to=<unix s>] [--from-seq=<n>] [--to-seq=<n>]
+//                  [--connection=<id>] [--grep=<substring>] [--with-meta] [--count]
+
+struct log_query
+{
+	std::uint64_t _from = 0;
+	std::uint64_t _to = UINT64_MAX;
+	std::uint64_t _from_sequence = 0;
+	std::uint64_t _to_sequence = UINT64_MAX;
+	bool _by_connection = false;
+	std::uint64_t _connection = 0;
+	std::string_view _needle;
+	bool _with_meta = false;
+	bool _count = false;
+
+	inline bool before(std::uint64_t timestamp, std::uint64_t sequence) const { return timestamp < this->_from || sequence < this->_from_sequence; }
+	inline bool after(std::uint64_t timestamp, std::uint64_t sequence) const { return timestamp > this->_to || sequence > this->_to_sequence; }
+};
+
+struct query_stats
+{
+	std::uint64_t _segments = 0;
+	std::uint64_t _bytes = 0;
+	std::uint64_t _records = 0;
+	std::uint64_t _matches = 0;
+};
+
+// Compares the first and last byte of the needle at 16 positions per step and checks the few
+// positions where both match, memmem covers the tail and CPUs without SSE2
+static bool contains(const char* data, std::size_t length, std::string_view needle)
+{
+	auto n = needle.size();
+
+	if (n == 0)
+		return true;
+
+	if (n > length)
+		return false;
+
+	std::size_t i = 0;
+
+#if defined(__SSE2__)
+	auto first = _mm_set1_epi8(needle.front());
+	auto last = _mm_set1_epi8(needle.back());
+
+	for (; i + n - 1 + 16 <= length; i += 16)
+	{
+		auto block_first = _mm_loadu_si128((const __m128i*)(data + i));
+		auto block_last = _mm_loadu_si128((const __m128i*)(data + i + n - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+
+		for (; mask != 0; mask &= mask - 1)
+		{
+			if (std::memcmp(data + i + __builtin_ctz(mask), needle.data(), n) == 0)
+				return true;
+		}
+	}
+#endif
+
+	return memmem(data + i, length - i, needle.data(), n) != nullptr;
+}
+
+static std::uint64_t parse_unix_ns(const char* arg)
+{
+	return (std::uint64_t)(std::strtod(arg, nullptr) * 1e9);
+}
+
+// Offset of the last indexed record in front of the range, where the walk starts
+static std::uint64_t start_offset(const log_segment& segment, const log_query& query)
+{
+	auto index = read_log_index(segment._index_path.c_str());
+
+	auto it = std::partition_point(index.begin(), index.end(), [&query](const log_index_entry& entry)
+	{
+		return query.before(entry._timestamp, entry._sequence);
+	});
+
+	return it == index.begin() ? 0 : (it - 1)->_offset;
+}
+
+// Walks the matching records of one log directory, a segment at a time. The record next()
+// returns stays valid until the following call.
+class shard_reader
+{
+	const log_query& _query;
+	query_stats& _stats;
+	std::vector<log_segment> _segments;
+	std::size_t _next_segment = 0;
+	bool _in_range = true;
+
+	const log_segment* _segment = nullptr;
+	int _fd = -1;
+	const char* _data = nullptr;
+	std::size_t _length = 0;
+	std::size_t _start = 0;
+	std::size_t _offset = 0;
+
+	// A segment ends where the next one starts, so one that the next starts in front of the range
+	// holds nothing of it. The first index entry of a segment is its first record.
+	bool skipped(std::size_t i) const
+	{
+		if (i + 1 == this->_segments.size())
+			return false;
+
+		auto next = read_log_index(this->_segments[i + 1]._index_path.c_str());
+
+		return this->_segments[i + 1]._first_sequence <= this->_query._from_sequence
+			|| (!next.empty() && next.front()._timestamp < this->_query._from);
+	}
+
+	bool open_next()
+	{
+		while (this->_next_segment < this->_segments.size())
+		{
+			auto i = this->_next_segment++;
+
+			if (this->skipped(i))
+				continue;
+
+			auto& segment = this->_segments[i];
+			auto fd = open(segment._path.c_str(), O_RDONLY | O_CLOEXEC);
+
+			if (fd < 0)
+			{
+				std::fprintf(stderr, "%s: open failed\n", segment._path.c_str());
+				continue;
+			}
+
+			struct stat st{};
+			fstat(fd, &st);
+
+			if (st.st_size == 0)
+			{
+				close(fd);
+				continue;
+			}
+
+			auto data = (const char*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+			if (data == MAP_FAILED)
+			{
+				std::fprintf(stderr, "%s: mmap failed\n", segment._path.c_str());
+				close(fd);
+				continue;
+			}
+
+			this->_segment = &segment;
+			this->_fd = fd;
+			this->_data = data;
+			this->_length = st.st_size;
+			this->_start = this->_offset = std::min<std::uint64_t>(start_offset(segment, this->_query), this->_length);
+
+			auto page = this->_offset & ~(std::uint64_t)4095;
+			madvise((void*)(data + page), this->_length - page, MADV_SEQUENTIAL);
+			return true;
+		}
+
+		return false;
+	}
+
+	void close_segment()
+	{
+		if (this->_in_range && this->_offset != this->_length)
+			std::fprintf(stderr, "%s: %zu bytes after offset %zu are torn or corrupted\n", this->_segment->_path.c_str(), this->_length - this->_offset, this->_offset);
+
+		this->_stats._segments++;
+		this->_stats._bytes += this->_offset - this->_start;
+
+		munmap((void*)this->_data, this->_length);
+		close(this->_fd);
+		this->_segment = nullptr;
+		this->_fd = -1;
+	}
+public:
+	shard_reader(const char* dir, const log_query& query, query_stats& stats) :
+		_query(query), _stats(stats), _segments(list_log_segments(dir))
+	{
+
+	}
+
+	shard_reader(const shard_reader&) = delete;
+
+	~shard_reader()
+	{
+		if (this->_segment != nullptr)
+			this->close_segment();
+	}
+
+	// False once the range or the log ended; the later segments are not read then
+	bool next(log_record_header& header, const char*& payload)
+	{
+		auto& query = this->_query;
+
+		while (this->_in_range)
+		{
+			if (this->_segment == nullptr && !this->open_next())
+				return false;
+
+			// the segment ends at its last valid record
+			if (read_log_record(this->_data + this->_offset, this->_length - this->_offset, header, payload))
+			{
+				if (query.after(header._timestamp, header._sequence))
+				{
+					this->_in_range = false;
+					this->close_segment();
+					return false;
+				}
+
+				this->_offset += sizeof(header) + header._length;
+
+				// a blob that never completed
+				if (is_log_placeholder(header))
+					continue;
+
+				this->_stats._records++;
+
+				if (query.before(header._timestamp, header._sequence)
+					|| (query._by_connection && header._connection != query._connection)
+					|| !contains(payload, header._length, query._needle))
+					continue;
+
+				return true;
+			}
+
+			this->close_segment();
+		}
+
+		return false;
+	}
+};
+
+// Merge order of the shards' records, worker ids break timestamp ties
+static bool merged_before(const log_record_header& a, const log_record_header& b)
+{
+	if (a._timestamp != b._timestamp)
+		return a._timestamp < b._timestamp;
+
+	if (a._connection >> 48 != b._connection >> 48)
+		return a._connection >> 48 < b._connection >> 48;
+
+	return a._sequence < b._sequence;
+}
+
+static void print_record(const log_query& query, const log_record_header& header, const char* payload)
+{
+	if (query._with_meta)
+		std::printf("%llu %llu %llu ", (unsigned long long)header._timestamp, (unsigned long long)header._connection, (unsigned long long)header._sequence);
+
+	std::fwrite(payload, 1, header._length, stdout);
+	std::fputc('\n', stdout);
+}
+
+int main(int argc, char** argv)
+{
+	log_query query;
+	std::vector<const char*> dirs;
+
+	for (int i = 1; i < argc; i++)
+	{
+		auto arg = argv[i];
+
+		if (std::strncmp(arg, "--from=", 7) == 0)
+			query._from = parse_unix_ns(arg + 7);
+		else if (std::strncmp(arg, "--to=", 5) == 0)
+			query._to = parse_unix_ns(arg + 5);
+		else if (std::strncmp(arg, "--from-seq=", 11) == 0)
+			query._from_sequence = std::strtoull(arg + 11, nullptr, 10);
+		else if (std::strncmp(arg, "--to-seq=", 9) == 0)
+			query._to_sequence = std::strtoull(arg + 9, nullptr, 10);
+		else if (std::strncmp(arg, "--connection=", 13) == 0)
+		{
+			query._by_connection = true;
+			query._connection = std::strtoull(arg + 13, nullptr, 0);
+		}
+		else if (std::strncmp(arg, "--grep=", 7) == 0)
+			query._needle = arg + 7;
+		else if (std::strcmp(arg, "--with-meta") == 0)
+			query._with_meta = true;
+		else if (std::strcmp(arg, "--count") == 0)
+			query._count = true;
+		else if (std::strncmp(arg, "--", 2) == 0)
+			std::fprintf(stderr, "unknown option \"%s\"\n", arg);
+		else
+			dirs.push_back(arg);
+	}
+
+	if (dirs.empty())
+	{
+		std::fprintf(stderr, "usage: %s <log dir>... [--from=<unix s>] [--to=<unix s>] [--from-seq=<n>] [--to-seq=<n>] "
+			"[--connection=<id>] [--grep=<substring>] [--with-meta] [--count]\n", argv[0]);
+		return 1;
+	}
+
+	static char out_buffer[1 << 20];
+	std::setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+
+	query_stats stats;
+	auto start = tsc_clock::now();
+
+	struct shard_head
+	{
+		shard_reader* _reader;
+		log_record_header _header;
+		const char* _payload;
+	};
+
+	std::vector<std::unique_ptr<shard_reader>> readers;
+	std::vector<shard_head> heads;
+
+	// a min-heap of the next record of every shard
+	auto later = [](const shard_head& a, const shard_head& b) { return merged_before(b._header, a._header); };
+
+	for (auto dir : dirs)
+	{
+		auto& reader = readers.emplace_back(std::make_unique<shard_reader>(dir, query, stats));
+		shard_head head{ reader.get(), {}, nullptr };
+
+		if (reader->next(head._header, head._payload))
+		{
+			heads.push_back(head);
+			std::push_heap(heads.begin(), heads.end(), later);
+		}
+	}
+
+	while (!heads.empty())
+	{
+		std::pop_heap(heads.begin(), heads.end(), later);
+		auto& head = heads.back();
+
+		stats._matches++;
+
+		if (!query._count)
+			print_record(query, head._header, head._payload);
+
+		if (head._reader->next(head._header, head._payload))
+			std::push_heap(heads.begin(), heads.end(), later);
+		else
+			heads.pop_back();
+	}
+
+	if (query._count)
+		std::printf("%llu\n", (unsigned long long)stats._matches);
+
+	std::fflush(stdout);
+
+	auto ms = elapsed_ns(start) / 1e6;
+	std::fprintf(stderr, "%llu matches of %llu records, %llu segments, %.1f MB in %.1f ms\n", (unsigned long long)stats._matches,
+		(unsigned long long)stats._records, (unsigned long long)stats._segments, stats._bytes / 1e6, ms);
+
+	return 0;
+}
@@ -1,176 +1,677 @@
 #include <cstring>
+#include <cstddef>
+#include <cerrno>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <linux/filter.h>
 #include <arpa/inet.h>
 
 #include <fstream>
+#include <iterator>
 #include <string>
+#include <string_view>
+#include <algorithm>
 #include <chrono>
 #include <thread>
-
-#include <liburing.h>
+#include <memory>
+#include <vector>
+
+#include "net.hpp"
+#include "util.hpp"
+#include "timer.hpp"
+#include "write_fs.hpp"
+#include "stats.hpp"
+#include "waiter.hpp"
+#include "tsc.hpp"
+#include "placement.hpp"
+#include "buffer_pool.hpp"
+#include "connection.hpp"
+#include "handover.hpp"
+#include "shutdown.hpp"
+#include "log_recovery.hpp"
+#include "log_segment.hpp"
+#include "ring_loop.hpp"
+#include "coro.hpp"
+#include "server_connection.hpp"
+#include "kv_store.hpp"
+#include "policies.hpp"
+#include "protocols.hpp"
+#include "server_core.hpp"
 
 using namespace std::chrono_literals;
 
-auto remove_file(const char* filename)
+enum class server_mode
 {
-	std::remove(filename);
-}
+	ECHO,
+	PIPELINE,
+	BROADCAST,
+	PUBSUB,
+	KV,
+	CORO
+};
 
-class write_fs
+struct server_config
 {
-	std::fstream* _fs;
-public:
-	write_fs(const char* filename, std::ios_base::openmode mode)
+	int port = 1337;
+	server_mode mode = server_mode::ECHO;
+	std::uint32_t reply_delay_ms = 3000;
+	std::size_t max_queue_bytes = 1024 * 1024;
+	bool slow_subscriber_disconnect = false;
+	bool kv_persist = false;
+	std::uint32_t stats_interval_ms = 0;
+	wait_policy wait = wait_policy::power_saving();
+	bool napi = false;
+	int workers = 1;
+	std::vector<int> cpus;
+	bool incoming_cpu = false;
+	bool steer_cpu = false;
+	bool huge_pages = false;
+	bool prefault = false;
+	bool mlock = false;
+	const char* upgrade_socket = nullptr;
+	const char* takeover = nullptr;
+	bool handover_connections = false;
+	std::uint32_t shutdown_timeout_ms = 5000;
+	connection_deadlines deadlines;
+	bool recover_log = false;
+	bool binary_log = false;
+	bool splice_blobs = false;
+	bool direct_log = false;
+	log_segment_options segments;
+
+	static auto parse(int argc, char** argv)
 	{
-		_fs = new std::fstream(filename, mode | std::ios::out);
-		_fs->seekp(0, std::ios::beg);
+		server_config cfg{};
+
+		if (argc <= 1 || std::strncmp(argv[1], "--", 2) == 0)
+			std::printf("argc <= 1, use default port\n");
+		else
+			cfg.port = std::atoi(argv[1]);
+
+		for (int i = 1; i < argc; i++)
+		{
+			auto arg = argv[i];
+
+			if (std::strcmp(arg, "--mode=echo") == 0)
+				cfg.mode = server_mode::ECHO;
+			else if (std::strcmp(arg, "--mode=pipeline") == 0)
+				cfg.mode = server_mode::PIPELINE;
+			else if (std::strcmp(arg, "--mode=broadcast") == 0)
+				cfg.mode = server_mode::BROADCAST;
+			else if (std::strcmp(arg, "--mode=pubsub") == 0)
+				cfg.mode = server_mode::PUBSUB;
+			else if (std::strcmp(arg, "--mode=coro") == 0)
+				cfg.mode = server_mode::CORO;
+			else if (std::strcmp(arg, "--mode=kv") == 0)
+				cfg.mode = server_mode::KV;
+			else if (std::strcmp(arg, "--kv-persist") == 0)
+				cfg.kv_persist = true;
+			else if (std::strcmp(arg, "--recover-log") == 0)
+				cfg.recover_log = true;
+			else if (std::strcmp(arg, "--log-format=binary") == 0)
+				cfg.binary_log = true;
+			else if (std::strcmp(arg, "--log-format=text") == 0)
+				cfg.binary_log = false;
+			else if (std::strcmp(arg, "--log-direct") == 0)
+				cfg.direct_log = true;
+			else if (std::strcmp(arg, "--splice-blobs") == 0)
+				cfg.splice_blobs = true;
+			else if (std::strncmp(arg, "--log-segment-mb=", 17) == 0)
+				cfg.segments._segment_bytes = std::max(1ull, std::strtoull(arg + 17, nullptr, 10)) << 20;
+			else if (std::strncmp(arg, "--log-index-interval=", 21) == 0)
+				cfg.segments._index_interval = std::max(1, std::atoi(arg + 21));
+			else if (std::strncmp(arg, "--log-retain-mb=", 16) == 0)
+				cfg.segments._retain_bytes = std::strtoull(arg + 16, nullptr, 10) << 20;
+			else if (std::strncmp(arg, "--log-retain-minutes=", 21) == 0)
+				cfg.segments._retain_seconds = std::atoi(arg + 21) * 60;
+			else if (std::strncmp(arg, "--max-queue-bytes=", 18) == 0)
+				cfg.max_queue_bytes = std::strtoull(arg + 18, nullptr, 10);
+			else if (std::strcmp(arg, "--slow-policy=drop") == 0)
+				cfg.slow_subscriber_disconnect = false;
+			else if (std::strcmp(arg, "--slow-policy=disconnect") == 0)
+				cfg.slow_subscriber_disconnect = true;
+			else if (std::strncmp(arg, "--stats-interval-ms=", 20) == 0)
+				cfg.stats_interval_ms = std::atoi(arg + 20);
+			else if (std::strncmp(arg, "--wait=", 7) == 0)
+			{
+				if (!wait_policy::parse(arg + 7, cfg.wait))
+					std::printf("unknown wait policy \"%s\"\n", arg + 7);
+			}
+			else if (std::strncmp(arg, "--busy-poll-us=", 15) == 0)
+				cfg.wait = wait_policy::busy_poll(std::chrono::microseconds(std::atoi(arg + 15)));
+			else if (std::strcmp(arg, "--napi") == 0)
+				cfg.napi = true;
+			else if (std::strncmp(arg, "--workers=", 10) == 0)
+				cfg.workers = std::max(1, std::atoi(arg + 10));
+			else if (std::strncmp(arg, "--cpus=", 7) == 0)
+			{
+				cfg.cpus = parse_cpu_list(arg + 7);
+
+				if (cfg.cpus.empty())
+					std::printf("bad cpu list \"%s\"\n", arg + 7);
+			}
+			else if (std::strcmp(arg, "--incoming-cpu") == 0)
+				cfg.incoming_cpu = true;
+			else if (std::strcmp(arg, "--steer=cpu") == 0)
+				cfg.steer_cpu = true;
+			else if (std::strcmp(arg, "--steer=hash") == 0)
+				cfg.steer_cpu = false;
+			else if (std::strcmp(arg, "--huge-pages") == 0)
+				cfg.huge_pages = cfg.prefault = true;
+			else if (std::strcmp(arg, "--prefault") == 0)
+				cfg.prefault = true;
+			else if (std::strcmp(arg, "--mlock") == 0)
+				cfg.mlock = true;
+			else if (std::strncmp(arg, "--upgrade-socket=", 17) == 0)
+				cfg.upgrade_socket = arg + 17;
+			else if (std::strncmp(arg, "--takeover=", 11) == 0)
+				cfg.takeover = arg + 11;
+			else if (std::strcmp(arg, "--handover-connections") == 0)
+				cfg.handover_connections = true;
+			else if (std::strncmp(arg, "--shutdown-timeout-ms=", 22) == 0)
+				cfg.shutdown_timeout_ms = std::atoi(arg + 22);
+			else if (std::strncmp(arg, "--idle-timeout-ms=", 18) == 0)
+				cfg.deadlines._idle_ms = std::atoi(arg + 18);
+			else if (std::strncmp(arg, "--read-timeout-ms=", 18) == 0)
+				cfg.deadlines._read_ms = std::atoi(arg + 18);
+			else if (std::strncmp(arg, "--write-timeout-ms=", 19) == 0)
+				cfg.deadlines._write_ms = std::atoi(arg + 19);
+			else if (std::strncmp(arg, "--reply-delay-ms=", 17) == 0)
+				cfg.reply_delay_ms = std::atoi(arg + 17);
+			else if (std::strncmp(arg, "--", 2) == 0)
+				std::printf("unknown option \"%s\"\n", arg);
+		}
+
+		return cfg;
 	}
+};
+
+// Sockets of a SO_REUSEPORT group must all set the option before binding. SO_REUSEADDR lets a
+// restart bind while the connections its predecessor closed are still in TIME_WAIT.
+static bool listen_on(int sock, int port, bool reuseport)
+{
+	int one = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (reuseport)
+		setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+	sockaddr_in sockaddrin;
+	sockaddrin.sin_port = htons(port);
+	sockaddrin.sin_addr.s_addr = INADDR_ANY;
+	sockaddrin.sin_family = AF_INET;
 
-	~write_fs()
+	auto bind_ret = bind(sock, (const sockaddr*)&sockaddrin, sizeof(decltype(sockaddrin)));
+	if (bind_ret != 0)
 	{
-		delete this->_fs;
+		std::printf("bind return %d\n", bind_ret);
+		return false;
 	}
 
-	write_fs& write_string(const char* string, std::size_t str_length = 0)
+	auto listen_ret = listen(sock, 512);
+
+	if (listen_ret != 0)
 	{
-		this->_fs->write(string, str_length == 0 ? strlen(string) : str_length);
-		return *this;
+		std::printf("listen return %d\n", listen_ret);
+		return false;
 	}
 
-	void close()
+	return true;
+}
+
+static bool init_loop(ring_loop& loop, const server_config& cfg)
+{
+	auto io_uring_queue_init_ret = loop.init(1024);
+
+	if (io_uring_queue_init_ret < 0) {
+		std::printf("io_uring_queue_init return %d\n", io_uring_queue_init_ret);
+		return false;
+	}
+
+	loop.set_wait_policy(cfg.wait);
+
+	// NAPI busy polling spins for as long as the loop's own spin budget
+	if (cfg.napi)
 	{
-		this->_fs->close();	
+		auto busy_poll_us = std::chrono::duration_cast<std::chrono::microseconds>(cfg.wait._spin).count();
+		auto napi_ret = loop.register_napi(busy_poll_us != 0 ? busy_poll_us : 50, true);
+
+		if (napi_ret < 0)
+			std::printf("io_uring_register_napi return %d\n", napi_ret);
 	}
-};
 
-template <class chrono_time_type>
-auto ex_sleep(std::uint64_t time)
+	return true;
+}
+
+// Worker i runs on the i-th CPU of --cpus, wrapping around when there are more workers than CPUs
+static int worker_cpu(const server_config& cfg, int worker)
 {
-	auto timepoint = std::chrono::system_clock::now();
-	while (std::chrono::duration_cast<chrono_time_type>(std::chrono::system_clock::now() - timepoint).count() < time);
+	return cfg.cpus.empty() ? -1 : cfg.cpus[worker % cfg.cpus.size()];
 }
 
-class ip_sock {
-	int sock;
-public:
-	ip_sock() { this->sock = socket(AF_INET, SOCK_STREAM, 0); }
-	~ip_sock() { close(this->sock); }
+// Reuseport program returning the index of the worker pinned to the CPU that received the SYN.
+// Any other CPU gets an index past the end of the group, which makes the kernel fall back to
+// its usual hash.
+static bool attach_cpu_steering(int sock, const server_config& cfg)
+{
+	std::vector<sock_filter> code;
+	code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (std::uint32_t)(SKF_AD_OFF + SKF_AD_CPU)));
 
-	inline auto& get_sock() { return this->sock; }
-	inline operator int() { return this->get_sock(); }
-	inline operator bool() { return (bool)this->get_sock(); }
-};
+	for (int i = 0; i < cfg.workers; i++)
+	{
+		code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (std::uint32_t)worker_cpu(cfg, i), 0, 1));
+		code.push_back(BPF_STMT(BPF_RET | BPF_K, (std::uint32_t)i));
+	}
+
+	code.push_back(BPF_STMT(BPF_RET | BPF_K, UINT32_MAX));
+
+	sock_fprog prog{ (unsigned short)code.size(), code.data() };
+
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0)
+	{
+		std::printf("SO_ATTACH_REUSEPORT_CBPF failed (%d), connections are hashed\n", errno);
+		return false;
+	}
+
+	return true;
+}
 
-template <class type, std::size_t size>
-class to_string
+static void pin_worker(const server_config& cfg, int worker)
 {
-	type buf[size];
-public:
-	template <class... args>
-	to_string(const type* s, args&&... arg) { sprintf(this->buf, s, arg...); }
+	auto cpu = worker_cpu(cfg, worker);
+
+	if (cpu < 0)
+		return;
 
-	inline auto get() { return this->buf; }
-	inline operator type*() { return this->get(); }
+	if (auto ret = pin_current_thread(cpu); ret != 0)
+		std::printf("worker %d: pinning to cpu %d failed (%d)\n", worker, cpu, ret);
+	else
+		std::printf("worker %d: cpu %d node %d\n", worker, cpu, cpu_numa_node(cpu));
+}
+
+// Buffer pools of a worker live on the node of the CPU it is pinned to
+static buffer_pool_options pool_options(const server_config& cfg, int worker)
+{
+	auto cpu = worker_cpu(cfg, worker);
+	return { cfg.huge_pages, cfg.prefault, cfg.mlock, cpu >= 0 ? cpu_numa_node(cpu) : -1 };
+}
+
+// A worker's message log shard, a text file or a directory of binary segments, and for binary
+// logs where its sequence and hybrid clock continue
+struct log_target
+{
+	std::string _path;
+	std::uint64_t _next_sequence = 0;
+	std::uint64_t _last_timestamp = 0;
 };
 
-template <std::size_t size>
-using to_ch_string = to_string<char, size>;
+// Cuts a torn tail off a kept log, so appending resumes on a record boundary. Binary logs only
+// recover their newest segment, the sealed ones were synced when they filled up.
+static void recover_log_file(log_target& log, const server_config& cfg)
+{
+	auto start = tsc_clock::now();
+	auto recovery = cfg.binary_log ? recover_segmented_log(log._path.c_str(), cfg.segments._index_interval) : recover_log(log._path.c_str());
+	auto ms = elapsed_ns(start) / 1e6;
+
+	if (!recovery._ok)
+	{
+		std::printf("log %s: recovery failed (%d)\n", log._path.c_str(), errno);
+		return;
+	}
 
-template <class rep, class per>
-class c2kts
+	log._next_sequence = recovery._next_sequence;
+	log._last_timestamp = recovery._last_timestamp;
+
+	std::printf("log %s: %llu records, %llu bytes, dropped %llu torn bytes in %.1f ms\n", log._path.c_str(),
+		(unsigned long long)recovery._records, (unsigned long long)recovery._valid_bytes, (unsigned long long)recovery._torn_bytes, ms);
+}
+
+// Calls on_line(line) for every persisted message of the log, in either format
+template <class fn>
+static void read_log_lines(const log_target& log, bool binary, fn&& on_line)
 {
-	__kernel_timespec _kts;
-public:
-	constexpr c2kts(const std::chrono::duration<rep, per>&& t) : _kts{}
+	if (!binary)
 	{
-		auto sec = std::chrono::duration_cast<std::chrono::seconds>(t);
-		_kts = { sec.count(), std::chrono::duration_cast<std::chrono::nanoseconds>(t - sec).count() };
+		std::ifstream file(log._path);
+		std::string line;
+
+		while (std::getline(file, line))
+			on_line(std::string_view(line));
+
+		return;
 	}
 
-	auto* get_kts()
+	for (auto& segment : list_log_segments(log._path.c_str()))
 	{
-		return &this->_kts;
+		std::ifstream file(segment._path, std::ios::binary);
+		std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+		for_each_log_record(data.data(), data.size(), [&](const log_record_header& header, const char* payload)
+		{
+			if (!is_log_placeholder(header))
+				on_line(std::string_view(payload, header._length));
+		});
 	}
+}
+
+// Hot upgrade side of a stream server: the handover channel it waits on, and the connections
+// it took over from the process it replaced
+struct hot_upgrade
+{
+	int _listen = -1;
+	bool _connections = false;
+	std::vector<handover_fd> _adopted;
 };
-#define chrono_to_timespec(t) [](){ constexpr c2kts obj(t); return obj; }().get_kts()
 
-int main(int argc, char** argv)
+// The stock build: printf logging and the configured reply delay, the protocol and sink follow the mode
+template <class protocol, class sink>
+int run_stream_server(ring_loop& loop, int sock, const server_config& cfg, int worker, shutdown_signal& signals, protocol proto, sink persist, hot_upgrade upgrade = {})
 {
-	std::printf("%s\n", argv[0]);
+	server_core<stdout_logger, sink, protocol, delayed_reply> core(loop, sock, {}, std::move(persist), std::move(proto), delayed_reply(cfg.reply_delay_ms), pool_options(cfg, worker));
+	core.set_worker(worker, worker_cpu(cfg, worker));
+	core.adopt(std::move(upgrade._adopted));
+	core.set_deadlines(cfg.deadlines);
 
-	auto port = 1337;
+	if (signals.signal_fd() >= 0)
+		core.enable_shutdown(&signals, worker == 0, std::chrono::milliseconds(cfg.shutdown_timeout_ms));
 
-	if (argc <= 1)
-		std::printf("argc <= 1, use default port\n");
-	else
+	if (upgrade._listen >= 0)
+		core.enable_upgrade(upgrade._listen, upgrade._connections);
+
+	core.run(cfg.stats_interval_ms);
+	return 0;
+}
+
+// run_stream_server with the sink of the configured log format
+template <class protocol>
+int run_logged_server(ring_loop& loop, int sock, const server_config& cfg, int worker, shutdown_signal& signals, protocol proto, const log_target& log, hot_upgrade upgrade = {})
+{
+	if (cfg.binary_log)
+		return run_stream_server(loop, sock, cfg, worker, signals, std::move(proto), record_sink(log._path.c_str(), cfg.segments, log._next_sequence, log._last_timestamp), std::move(upgrade));
+
+	if (cfg.direct_log)
+	{
+		auto file = std::make_unique<direct_fs>(log._path.c_str());
+
+		if (file->is_open())
+			return run_stream_server(loop, sock, cfg, worker, signals, std::move(proto), direct_sink(std::move(file)), std::move(upgrade));
+
+		std::printf("log %s: O_DIRECT is not available (%d), writing through the page cache\n", log._path.c_str(), errno);
+	}
+
+	return run_stream_server(loop, sock, cfg, worker, signals, std::move(proto), file_sink(log._path.c_str()), std::move(upgrade));
+}
+
+// One shard of the pipeline mode with its own listener in the SO_REUSEPORT group, ring and
+// connection slots. The worker pins itself before creating any of them, so first touch places
+// the ring, the slot table and the log batches on the node of its CPU.
+static void pipeline_worker(const server_config& cfg, int worker, int sock, log_target log, shutdown_signal& signals)
+{
+	pin_worker(cfg, worker);
+
+	ring_loop loop;
+
+	if (!init_loop(loop, cfg))
+		return;
+
+	run_logged_server(loop, sock, cfg, worker, signals, pipeline_protocol{ cfg.splice_blobs }, log);
+}
+
+// The echo protocol written sequentially on top of the coroutine layer
+coro::task coro_serve_client(int sock, write_fs& message_log, std::chrono::milliseconds reply_delay)
+{
+	constexpr auto MAX_MESSAGE_LENGTH = 128;
+	char buffer[MAX_MESSAGE_LENGTH + 1];
+
+	while (true)
 	{
-		port = std::atoi(argv[1]);
+		auto received = co_await coro::recv(sock, buffer, MAX_MESSAGE_LENGTH);
+
+		if (received <= 0)
+			break;
+
+		message_log
+			.write(buffer, received)
+			.write("\n", 1);
+
+		co_await coro::sleep(reply_delay);
+
+		static const char accepted_msg[] = "ACCEPTED";
+		if (co_await coro::send(sock, accepted_msg, sizeof(accepted_msg) - 1) <= 0)
+			break;
 	}
+
+	close(sock);
+	std::printf("disconnected client\n");
+}
+
+coro::task coro_accept_loop(int sock, write_fs& message_log, std::chrono::milliseconds reply_delay)
+{
+	while (true)
+	{
+		auto client = co_await coro::accept(sock);
+
+		if (client < 0)
+			continue;
+
+		std::printf("new client\n");
+		coro_serve_client(client, message_log, reply_delay);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::printf("%s\n", argv[0]);
+
+	auto cfg = server_config::parse(argc, argv);
+	auto port = cfg.port;
 	
 	to_ch_string<64 + 1> port_str("%d", port);
 
-	ip_sock sock;
+	if (cfg.workers > 1 && cfg.mode != server_mode::PIPELINE)
+	{
+		std::printf("--workers needs --mode=pipeline, the other modes share state between connections\n");
+		cfg.workers = 1;
+	}
 
-	if (!sock) {
-		std::printf("socket return %d", sock);
-		return 1;
+	if (cfg.incoming_cpu && cfg.cpus.empty())
+		std::printf("--incoming-cpu needs --cpus\n");
+
+	if ((cfg.upgrade_socket != nullptr || cfg.takeover != nullptr)
+		&& (cfg.workers > 1 || cfg.mode == server_mode::ECHO || cfg.mode == server_mode::CORO))
+	{
+		std::printf("--upgrade-socket and --takeover need a stream mode with one worker\n");
+		cfg.upgrade_socket = cfg.takeover = nullptr;
 	}
-	
-	sockaddr_in sockaddrin;
-	sockaddrin.sin_port = htons(port);
-	sockaddrin.sin_addr.s_addr = INADDR_ANY;
-	sockaddrin.sin_family = AF_INET;
 
-	auto bind_ret = bind(sock, (const sockaddr*)&sockaddrin, sizeof(decltype(sockaddrin)));
-	if (bind_ret != 0)
+	if (cfg.deadlines.enabled() && (cfg.mode == server_mode::ECHO || cfg.mode == server_mode::CORO))
+		std::printf("connection deadlines need a stream mode\n");
+
+	// The main thread is worker 0
+	pin_worker(cfg, 0);
+
+	// Before any thread exists, so the signals stay blocked everywhere and only reach the signalfd
+	shutdown_signal signals;
+
+	if (!signals.open())
+		std::printf("signalfd failed (%d), SIGTERM and SIGINT are not drained\n", errno);
+
+	// A takeover starts with the listener and connections of the running server, which returns
+	// only after it flushed its log and stopped reading
+	hot_upgrade upgrade;
+	std::vector<int> taken_listeners;
+
+	if (cfg.takeover != nullptr)
 	{
-		std::printf("bind return %d\n", bind_ret);
-		return 1;
+		if (!handover_receive(cfg.takeover, taken_listeners, upgrade._adopted))
+		{
+			std::printf("takeover from %s failed\n", cfg.takeover);
+			return 1;
+		}
+
+		std::printf("took over %zu listeners and %zu connections\n", taken_listeners.size(), upgrade._adopted.size());
 	}
 
-	auto listen_ret = listen(sock, 512);
+	if (cfg.upgrade_socket != nullptr)
+	{
+		upgrade._listen = handover_listen(cfg.upgrade_socket);
+		upgrade._connections = cfg.handover_connections;
 
-	if (listen_ret != 0)
+		if (upgrade._listen < 0)
+			std::printf("upgrade socket %s: %d\n", cfg.upgrade_socket, errno);
+	}
+
+	// Created up front in worker order, the order the reuseport group indexes its sockets in.
+	// With SO_INCOMING_CPU the kernel prefers the listener of the CPU that took the SYN.
+	std::vector<std::unique_ptr<ip_sock>> listeners;
+
+	for (int i = 0; i < cfg.workers; i++)
 	{
-		std::printf("listen return %d\n", listen_ret);
-		return 1;
+		if (i < (int)taken_listeners.size())
+		{
+			listeners.emplace_back(std::make_unique<ip_sock>(taken_listeners[i]));
+			continue;
+		}
+
+		auto& listener = *listeners.emplace_back(std::make_unique<ip_sock>());
+
+		if (!listener) {
+			std::printf("socket return %d", listener.get_sock());
+			return 1;
+		}
+
+		if (!listen_on(listener, port, cfg.workers > 1))
+			return 1;
+
+		if (auto cpu = worker_cpu(cfg, i); cfg.incoming_cpu && cpu >= 0)
+			setsockopt(listener, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
 	}
 
-	std::string output_filename = std::string(port_str.get()) + ".txt";
+	auto& sock = *listeners[0];
 
-	remove_file(output_filename.c_str());
+	if (cfg.steer_cpu)
+	{
+		if (cfg.workers > 1 && !cfg.cpus.empty())
+			attach_cpu_steering(sock, cfg);
+		else
+			std::printf("--steer=cpu needs --workers and --cpus\n");
+	}
 
-	io_uring ioring;
-	auto io_uring_queue_init_ret = io_uring_queue_init(1024, &ioring, 0);
+	if (cfg.binary_log && (cfg.mode == server_mode::ECHO || cfg.mode == server_mode::CORO))
+	{
+		std::printf("--log-format=binary needs a stream mode, the log stays text\n");
+		cfg.binary_log = false;
+	}
 
-	if (io_uring_queue_init_ret < 0) {
-		std::printf("io_uring_queue_init return %d\n", io_uring_queue_init_ret);
-		return 1;
+	if (cfg.direct_log && (cfg.binary_log || cfg.mode == server_mode::ECHO || cfg.mode == server_mode::CORO))
+	{
+		std::printf("--log-direct needs a stream mode with a text log\n");
+		cfg.direct_log = false;
 	}
 
-	struct uring_sock_udata_t
+	if (cfg.splice_blobs && (cfg.mode != server_mode::PIPELINE || !cfg.binary_log))
 	{
-		enum user_command
+		std::printf("--splice-blobs needs --mode=pipeline and --log-format=binary, BLOB lines stay messages\n");
+		cfg.splice_blobs = false;
+	}
+
+	if (cfg.binary_log && cfg.mode == server_mode::KV && cfg.kv_persist && (cfg.segments._retain_bytes != 0 || cfg.segments._retain_seconds != 0))
+		std::printf("log retention drops kv history, the restored keys will be incomplete\n");
+
+	// Every worker appends to its own log shard with its own batch, so no lock is shared between
+	// them. <port>.txt (the <port>-log segment directory when binary) stays worker 0's, the
+	// binary shards are merged into one order by server_logtool.
+	std::vector<log_target> logs(cfg.workers);
+
+	for (int i = 0; i < cfg.workers; i++)
+		logs[i]._path = std::string(port_str.get()) + (i == 0 ? "" : "-" + std::to_string(i)) + (cfg.binary_log ? "-log" : ".txt");
+
+	auto& output_filename = logs[0]._path;
+
+	// A takeover keeps appending to the logs of the process it replaces. Otherwise they start empty,
+	// unless they are kept: the kv history always, the other logs with --recover-log. A binary log
+	// that is appended to is always scanned, its records continue the sequence of the last valid one.
+	for (auto& log : logs)
+	{
+		if (cfg.takeover != nullptr)
 		{
-			ACCEPT,
-			RECEIVE,
-			SEND_TIMEOUT,
-			SEND,
-			MAX_SIZE_CMD
-		} 
-		_ucmd;
-		int _sock;
-		char* _received_data;
-		std::chrono::system_clock::time_point _timestamp;
-
-		uring_sock_udata_t(user_command ucmd, int sock, char* received_data = nullptr, std::chrono::system_clock::time_point _timestamp = {}) : 
-			_ucmd(ucmd), _sock(sock), _received_data(received_data), _timestamp(_timestamp)
+			if (cfg.binary_log)
+				recover_log_file(log, cfg);
+		}
+		else if (cfg.recover_log || (cfg.mode == server_mode::KV && cfg.kv_persist))
+			recover_log_file(log, cfg);
+		else if (cfg.binary_log)
+			remove_log_segments(log._path.c_str());
+		else
+			remove_file(log._path.c_str());
+	}
+
+	kv_store kv;
+
+	// With persistence the log holds the SET/DEL history, replay it instead of starting empty
+	if (cfg.mode == server_mode::KV && cfg.kv_persist)
+	{
+		read_log_lines(logs[0], cfg.binary_log, [&kv](std::string_view args)
 		{
-			
+			auto cmd = next_token(args);
+
+			if (cmd == "SET")
+			{
+				auto key = next_token(args);
+				kv.set(key, args);
+			}
+			else if (cmd == "DEL")
+				kv.del(args);
+		});
+
+		std::printf("kv restored %zu keys\n", kv.size());
+	}
+
+	ring_loop loop;
+
+	if (!init_loop(loop, cfg))
+		return 1;
+
+	auto& ioring = loop.get();
+
+	switch (cfg.mode)
+	{
+		case server_mode::PIPELINE:
+		{
+			std::vector<std::thread> workers;
+
+			for (int i = 1; i < cfg.workers; i++)
+				workers.emplace_back(pipeline_worker, std::cref(cfg), i, listeners[i]->get_sock(), logs[i], std::ref(signals));
+
+			auto ret = run_logged_server(loop, sock, cfg, 0, signals, pipeline_protocol{ cfg.splice_blobs }, logs[0], std::move(upgrade));
+
+			for (auto& worker : workers)
+				worker.join();
+
+			return ret;
 		}
-	};
+		case server_mode::BROADCAST:
+		{
+			auto policy = cfg.slow_subscriber_disconnect ? slow_subscriber_policy::DISCONNECT : slow_subscriber_policy::DROP;
+			return run_logged_server(loop, sock, cfg, 0, signals, broadcast_protocol(cfg.max_queue_bytes, policy), logs[0], std::move(upgrade));
+		}
+		case server_mode::PUBSUB:
+		{
+			auto policy = cfg.slow_subscriber_disconnect ? slow_subscriber_policy::DISCONNECT : slow_subscriber_policy::DROP;
+			return run_logged_server(loop, sock, cfg, 0, signals, pubsub_protocol(cfg.max_queue_bytes, policy), logs[0], std::move(upgrade));
+		}
+		case server_mode::KV:
+		{
+			if (cfg.kv_persist)
+				return run_logged_server(loop, sock, cfg, 0, signals, kv_protocol(std::move(kv)), logs[0], std::move(upgrade));
+
+			return run_stream_server(loop, sock, cfg, 0, signals, kv_protocol(std::move(kv)), null_sink{}, std::move(upgrade));
+		}
+		default:
+			break;
+	}
 
 	auto next_accept = [](io_uring& ioring, ip_sock& sock) -> void
 	{
@@ -179,38 +680,45 @@ int main(int argc, char** argv)
 		static sockaddr_in sockaddrin_client{};
 		static auto sockaddrin_client_length = sizeof(decltype(sockaddrin_client));
 		io_uring_prep_accept(sqe, sock, (sockaddr*)&sockaddrin_client, (socklen_t*)&sockaddrin_client_length, 0);
-		io_uring_sqe_set_data(sqe, new uring_sock_udata_t{ uring_sock_udata_t::ACCEPT, sock, nullptr, std::chrono::system_clock::now() });
+		io_uring_sqe_set_data(sqe, new uring_sock_udata_t{ server_command::ACCEPT, sock, nullptr, tsc_clock::now() });
 		io_uring_submit(&ioring);
 	};
 
 	auto trigger_receive = [](io_uring& ioring, int sock) -> void
 	{
-		io_uring_sqe_set_data(io_uring_get_sqe(&ioring), new uring_sock_udata_t{ uring_sock_udata_t::RECEIVE, sock, nullptr, std::chrono::system_clock::now() });
+		auto sqe = io_uring_get_sqe(&ioring);
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, new uring_sock_udata_t{ server_command::RECEIVE, sock, nullptr, tsc_clock::now() });
 		io_uring_submit(&ioring);
 	};
 
-	auto next_receive = [](io_uring& ioring, int sock) -> void
+	constexpr auto MAX_MESSAGE_LENGTH = 128;
+	buffer_pool receive_buffers(MAX_MESSAGE_LENGTH + 1, 1024, pool_options(cfg, 0));
+
+	if (auto ret = loop.register_buffers(receive_buffers); ret < 0)
+		std::printf("io_uring_register_buffers return %d\n", ret);
+
+	auto next_receive = [&receive_buffers](io_uring& ioring, int sock) -> void
 	{
 		auto sqe = io_uring_get_sqe(&ioring);
+		auto buffer = receive_buffers.acquire();
 
-		constexpr auto MAX_MESSAGE_LENGTH = 128;
-		auto buffer = new (std::nothrow) char[MAX_MESSAGE_LENGTH + 1]();
+		if (auto index = receive_buffers.fixed_index(buffer); index >= 0)
+			io_uring_prep_read_fixed(sqe, sock, buffer, MAX_MESSAGE_LENGTH, 0, index);
+		else
+			io_uring_prep_recv(sqe, sock, buffer, MAX_MESSAGE_LENGTH, 0);
 
-		if (buffer == nullptr) {
-			std::printf("Fatal error allocate\n");
-			raise(SIGTRAP);
-		}
-
-		io_uring_prep_recv(sqe, sock, buffer, MAX_MESSAGE_LENGTH, 0);
-		io_uring_sqe_set_data(sqe, new uring_sock_udata_t{ uring_sock_udata_t::RECEIVE, sock, buffer, std::chrono::system_clock::now() });
+		io_uring_sqe_set_data(sqe, new uring_sock_udata_t{ server_command::RECEIVE, sock, buffer, tsc_clock::now() });
 		io_uring_submit(&ioring);
 	};
 
-	auto next_send_timeout = [](io_uring& ioring, int sock) -> void
+	auto send_delay_kts = to_kts(3s);
+
+	auto next_send_timeout = [&send_delay_kts](io_uring& ioring, int sock) -> void
 	{
 		auto sqe = io_uring_get_sqe(&ioring);
-		io_uring_prep_timeout(sqe, chrono_to_timespec(3s), 0, 0);
-		io_uring_sqe_set_data(sqe, new uring_sock_udata_t{ uring_sock_udata_t::SEND_TIMEOUT, sock, nullptr, std::chrono::system_clock::now() });
+		io_uring_prep_timeout(sqe, &send_delay_kts, 0, 0);
+		io_uring_sqe_set_data(sqe, new uring_sock_udata_t{ server_command::SEND_TIMEOUT, sock, nullptr, tsc_clock::now() });
 		io_uring_submit(&ioring);
 	};
 
@@ -220,52 +728,88 @@ int main(int argc, char** argv)
 
 		static char accepted_msg[] = "ACCEPTED";
 		io_uring_prep_send(sqe, sock, accepted_msg, strlen(accepted_msg), 0);
-		io_uring_sqe_set_data(sqe, new uring_sock_udata_t{ uring_sock_udata_t::SEND, sock, nullptr, std::chrono::system_clock::now() });
+		io_uring_sqe_set_data(sqe, new uring_sock_udata_t{ server_command::SEND, sock, nullptr, tsc_clock::now() });
 		io_uring_submit(&ioring);
 
 		std::printf("Sended message \"ACCEPTED\"\n");
 	};
 
-	next_accept(ioring, sock);
+	write_fs message_log(output_filename.c_str(), std::ios::app);
+	stats_timer stats(cfg.stats_interval_ms);
 
-	while (true) 
+	// SIGTERM/SIGINT stop accepting; replies already waiting for their delay still go out, then their
+	// connection is closed instead of receiving again. Coroutine connections are not tracked, so the
+	// coro mode stops right away.
+	signalfd_siginfo siginfo{};
+	uring_sock_udata_t signal_op(server_command::SHUTDOWN_SIGNAL, signals.signal_fd());
+	uring_sock_udata_t deadline_op(server_command::SHUTDOWN_DEADLINE, -1);
+	auto deadline_kts = to_kts(std::chrono::milliseconds(cfg.shutdown_timeout_ms));
+	bool draining = false;
+	std::size_t replies_pending = 0;
+
+	auto next_signal_read = [&]() -> void
 	{
-		static io_uring_cqe *cqe_arr[256];
-		std::memset(cqe_arr, 0, sizeof(cqe_arr));
+		auto sqe = loop.acquire_sqe();
+		io_uring_prep_read(sqe, signals.signal_fd(), &siginfo, sizeof(siginfo), 0);
+		io_uring_sqe_set_data(sqe, &signal_op);
+	};
 
-		auto wait_cqe = io_uring_wait_cqe(&ioring, &cqe_arr[0]);
+	if (signals.signal_fd() >= 0)
+		next_signal_read();
 
-		auto cqe_num = io_uring_peek_batch_cqe(&ioring, cqe_arr, sizeof(cqe_arr) / sizeof(cqe_arr[0]));
-		for (int i = 0; i < cqe_num; i++) 
-		{
-			auto cqe = cqe_arr[i];
+	coro::worker worker{ &loop, {} };
+	coro::worker::_current = &worker;
+
+	if (cfg.mode == server_mode::CORO)
+		coro_accept_loop(sock, message_log, std::chrono::milliseconds(cfg.reply_delay_ms));
+	else
+		next_accept(ioring, sock);
+
+	if (cfg.stats_interval_ms != 0)
+		stats.arm(loop);
 
-			auto ud = (uring_sock_udata_t*)io_uring_cqe_get_data(cqe);
+	loop.submit();
 
+	loop.run([&](io_uring_cqe* cqe, uring_sock_udata_t* ud)
+		{
 			switch (ud->_ucmd)
 			{
-				case uring_sock_udata_t::user_command::ACCEPT:
+				case server_command::ACCEPT:
+					if (draining)
+					{
+						if (cqe->res >= 0)
+							close(cqe->res);
+
+						break;
+					}
+
 					next_accept(ioring, sock);
 					trigger_receive(ioring, cqe->res);
 					std::printf("new client\n");
 					break;
-				case uring_sock_udata_t::user_command::RECEIVE:
+				case server_command::RECEIVE:
 				{
 					auto msg_from_client = ud->_received_data;
 
 					if (msg_from_client == nullptr)
 					{
-						next_receive(ioring, ud->_sock);
+						if (draining)
+							close(ud->_sock);
+						else
+							next_receive(ioring, ud->_sock);
+
 						break;
 					}
 
 					if (msg_from_client && cqe->res <= 0)
 					{
 						std::printf("disconnected client\n");
+						receive_buffers.release(msg_from_client);
 						shutdown(ud->_sock, SHUT_RDWR);
 						break;
 					}		
 
+					msg_from_client[cqe->res] = '\0';
 					auto msg_len = strlen(msg_from_client);
 
 					std::printf("Msg length: %d Msg: \"%s\"\n", msg_len, msg_from_client);
@@ -275,28 +819,67 @@ int main(int argc, char** argv)
 						.write_string("\n")
 						.close();
 
-					delete msg_from_client;
+					receive_buffers.release(msg_from_client);
 
+					replies_pending++;
 					next_send_timeout(ioring, ud->_sock);
 					break;
 				}
-				case uring_sock_udata_t::user_command::SEND_TIMEOUT:
+				case server_command::SEND_TIMEOUT:
 				{
 					std::printf("send timeout\n");
 					next_send(ioring, ud->_sock);
 					break;
 				}
-				case uring_sock_udata_t::user_command::SEND:
+				case server_command::SEND:
 				{
-					next_receive(ioring, ud->_sock);
+					replies_pending--;
+
+					if (draining)
+						close(ud->_sock);
+					else
+						next_receive(ioring, ud->_sock);
+
 					break;
 				}
+				case server_command::STATS_TIMER:
+					stats.fire(loop);
+					return;
+				case server_command::SHUTDOWN_SIGNAL:
+				{
+					if (cqe->res < 0)
+					{
+						next_signal_read();
+						return;
+					}
+
+					std::printf("shutdown on signal %u, %zu replies pending\n", siginfo.ssi_signo, replies_pending);
+					draining = true;
+
+					auto sqe = loop.acquire_sqe();
+					io_uring_prep_timeout(sqe, &deadline_kts, 0, 0);
+					io_uring_sqe_set_data(sqe, &deadline_op);
+					return;
+				}
+				case server_command::SHUTDOWN_DEADLINE:
+					std::printf("shutdown deadline, %zu replies pending\n", replies_pending);
+					loop.stop();
+					return;
 			}
 
 			delete ud;
-			io_uring_cqe_seen(&ioring, cqe);
-		}
-	}
+		},
+		[&]()
+		{
+			message_log.flush();
 
+			if (draining && (replies_pending == 0 || cfg.mode == server_mode::CORO))
+				loop.stop();
+		});
+
+	if (!message_log.sync())
+		std::printf("log sync failed\n");
+
+	loop.stats().dump(stdout);
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "timer.hpp"
+#include "write_fs.hpp"
+#include "direct_fs.hpp"
+#include "log_segment.hpp"
+
+// Loggers: operator() reports connection events, trace() runs once per receive
+
+struct stdout_logger
+{
+	template <class... args>
+	inline void operator()(const char* fmt, args... a) const
+	{
+		if constexpr (sizeof...(a) == 0)
+			std::fputs(fmt, stdout);
+		else
+			std::printf(fmt, a...);
+	}
+
+	template <class... args>
+	inline void trace(const char*, args...) const {}
+};
+
+struct verbose_logger : stdout_logger
+{
+	template <class... args>
+	inline void trace(const char* fmt, args... a) const { (*this)(fmt, a...); }
+};
+
+struct null_logger
+{
+	template <class... args>
+	inline void operator()(const char*, args...) const {}
+
+	template <class... args>
+	inline void trace(const char*, args...) const {}
+};
+
+// Persistence sinks: write_record() stores one message of a connection, flush() runs once per
+// loop iteration, sync() once at shutdown. open_replay() opens what was stored from a sequence
+// on, only logs that number their records can. begin_spliced() starts a message whose payload the
+// core splices into the log itself, only binary logs take it.
+
+class file_sink
+{
+	std::unique_ptr<write_fs> _file;
+public:
+	file_sink(const char* filename) : _file(std::make_unique<write_fs>(filename, std::ios::app)) {}
+
+	// text lines carry the message only
+	inline void write_record(std::uint64_t, const char* data, std::size_t length)
+	{
+		this->_file
+			->write(data, length)
+			.write("\n", 1);
+	}
+
+	// raw payloads do not fit a line log, main only splices them with binary logs
+	inline bool begin_spliced(std::uint64_t, std::size_t, spliced_record&) { return false; }
+
+	inline void flush() { this->_file->flush(); }
+	inline bool sync() { return this->_file->sync(); }
+	inline bool open_replay(std::uint64_t, std::vector<log_span>&) { return false; }
+};
+
+// Text lines like file_sink, written around the page cache by a direct_fs
+class direct_sink
+{
+	std::unique_ptr<direct_fs> _file;
+public:
+	direct_sink(std::unique_ptr<direct_fs> file) : _file(std::move(file)) {}
+
+	inline void write_record(std::uint64_t, const char* data, std::size_t length)
+	{
+		this->_file
+			->write_string(data, length)
+			.write_string("\n", 1);
+	}
+
+	inline bool begin_spliced(std::uint64_t, std::size_t, spliced_record&) { return false; }
+
+	inline void flush() { this->_file->flush(); }
+	inline bool sync() { return this->_file->sync(); }
+	inline bool open_replay(std::uint64_t, std::vector<log_span>&) { return false; }
+};
+
+// Binary records with CRC32C in a segmented log, batched per iteration
+class record_sink
+{
+	std::unique_ptr<segmented_log> _log;
+public:
+	record_sink(const char* dir, const log_segment_options& options, std::uint64_t next_sequence, std::uint64_t last_timestamp) :
+		_log(std::make_unique<segmented_log>(dir, options, next_sequence, last_timestamp))
+	{
+
+	}
+
+	inline void write_record(std::uint64_t connection, const char* data, std::size_t length) { this->_log->append(connection, data, length); }
+	inline bool begin_spliced(std::uint64_t connection, std::size_t length, spliced_record& record) { return this->_log->begin_spliced(connection, length, record); }
+	inline void flush() { this->_log->flush(); }
+	inline bool sync() { return this->_log->sync(); }
+
+	// includes the records of the current iteration
+	bool open_replay(std::uint64_t from_sequence, std::vector<log_span>& spans)
+	{
+		this->_log->flush();
+		spans = open_log_spans(this->_log->dir().c_str(), from_sequence);
+		return true;
+	}
+};
+
+struct null_sink
+{
+	inline void write_record(std::uint64_t, const char*, std::size_t) {}
+	inline bool begin_spliced(std::uint64_t, std::size_t, spliced_record&) { return false; }
+	inline void flush() {}
+	inline bool sync() { return true; }
+	inline bool open_replay(std::uint64_t, std::vector<log_span>&) { return false; }
+};
+
+// Reply strategies: acks are queued at once when immediate(), otherwise after a delay() timeout
+
+class delayed_reply
+{
+	__kernel_timespec _delay;
+	bool _immediate;
+public:
+	delayed_reply(std::uint32_t delay_ms) : _delay(to_kts(std::chrono::milliseconds(delay_ms))), _immediate(delay_ms == 0) {}
+
+	inline bool immediate() const { return this->_immediate; }
+	inline __kernel_timespec* delay() { return &this->_delay; }
+};
+
+struct immediate_reply
+{
+	static constexpr bool immediate() { return true; }
+	inline __kernel_timespec* delay() { return nullptr; }
+};
@@ -0,0 +1,92 @@
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "util.hpp"
+#include "tsc.hpp"
+#include "write_fs.hpp"
+#include "ring_loop.hpp"
+#include "server_connection.hpp"
+#include "policies.hpp"
+#include "protocols.hpp"
+#include "server_core.hpp"
+
+// Drives the pipeline receive path of several server_core instantiations over the same synthetic
+// receives, next to a hand-written version without policies. Results go to stderr since the
+// verbose logger variant writes its traces to stdout.
+
+constexpr auto ROUNDS = 200000;
+constexpr auto LINES_PER_RECEIVE = 32;
+
+static std::string make_payload()
+{
+	std::string payload;
+
+	for (int i = 0; i < LINES_PER_RECEIVE; i++)
+		payload += to_ch_string<32>("message %06d\n", i).get();
+
+	return payload;
+}
+
+template <class fn>
+static void report(const char* name, fn&& receive)
+{
+	auto payload = make_payload();
+	auto conn = std::make_unique<server_connection>(-1);
+
+	auto start = tsc_clock::now();
+
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		std::memcpy(conn->_recv_buffer, payload.data(), payload.size());
+		receive(conn.get(), payload.size());
+		conn->_out.reset();
+	}
+
+	auto elapsed = elapsed_ns(start);
+	auto messages = (double)ROUNDS * LINES_PER_RECEIVE;
+
+	std::fprintf(stderr, "%-44s %8.2f ns/msg  seq %llu\n", name, elapsed / messages, (unsigned long long)conn->_seq);
+}
+
+template <class logger, class sink>
+static void report_core(const char* name, sink persist)
+{
+	// the receive path never touches the ring, an uninitialized loop is enough
+	ring_loop loop;
+	server_core<logger, sink, pipeline_protocol, immediate_reply> core(loop, -1, {}, std::move(persist), {}, {});
+
+	report(name, [&](server_connection* conn, std::size_t received)
+	{
+		core.process(conn, received);
+	});
+}
+
+int main()
+{
+	auto log_filename = "policy_bench.txt";
+
+	report("hand-written", [](server_connection* conn, std::size_t received)
+	{
+		conn->consume_lines(received, [&](const char*, std::size_t)
+		{
+			conn->_seq++;
+		});
+
+		to_ch_string<32> ack("ACCEPTED %llu\n", (unsigned long long)conn->_seq);
+		conn->_out.append(ack, std::strlen(ack));
+		conn->_acked_seq = conn->_seq;
+	});
+
+	report_core<null_logger>("core<null_logger, null_sink>", null_sink{});
+	report_core<stdout_logger>("core<stdout_logger, null_sink>", null_sink{});
+
+	remove_file(log_filename);
+	report_core<stdout_logger>("core<stdout_logger, file_sink>", file_sink(log_filename));
+	report_core<verbose_logger>("core<verbose_logger, file_sink>", file_sink(log_filename));
+	remove_file(log_filename);
+
+	return 0;
+}
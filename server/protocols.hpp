@@ -0,0 +1,344 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "connection.hpp"
+#include "server_connection.hpp"
+#include "topic_index.hpp"
+#include "kv_store.hpp"
+
+// Protocol policies for server_core, each one is a line framed mode of the server.
+// HANDS_OVER_CONNECTIONS tells whether a hot upgrade may pass idle connections to the new
+// process, which only works when the connection state outside the slot is rebuilt by on_accept.
+
+// Every line is persisted and counted, acks carry the last sequence number. With _blobs a line
+// "BLOB <n>" announces n raw bytes that follow it, persisted and counted as one message; the core
+// moves them from the socket to the log through a pipe, see server_core::expect_blob.
+struct pipeline_protocol
+{
+	static constexpr bool HANDS_OVER_CONNECTIONS = true;
+
+	bool _blobs = false;
+
+	template <class core_type>
+	void on_accept(core_type&, server_connection*) {}
+
+	template <class core_type>
+	void on_receive(core_type& core, server_connection* conn, std::size_t received)
+	{
+		conn->consume_lines(received, [&](const char* msg, std::size_t msg_len)
+		{
+			std::size_t blob_length = 0;
+
+			// the lines behind a blob header are its payload, the split stops there
+			if (this->_blobs && msg_len > 5 && std::memcmp(msg, "BLOB ", 5) == 0
+				&& std::from_chars(msg + 5, msg + msg_len, blob_length).ptr == msg + msg_len && blob_length != 0)
+			{
+				core.expect_blob(conn, blob_length);
+				return false;
+			}
+
+			core.persist(conn, msg, msg_len);
+			conn->_seq++;
+			return true;
+		});
+
+		core.acknowledge(conn);
+	}
+
+	template <class core_type>
+	void on_close(core_type&, server_connection*) {}
+
+	template <class core_type>
+	void on_iteration(core_type&) {}
+
+	void dump_stats(int) const {}
+};
+
+// Every connection subscribes on accept and gets every line any connection sends. Subscribers
+// whose queue is over max_queue_bytes are handled like in pubsub_protocol.
+class broadcast_protocol
+{
+	subscriber_list _subscribers;
+	std::vector<server_connection*> _slow_subscribers;
+	std::size_t _max_queue_bytes;
+	slow_subscriber_policy _policy;
+	std::uint64_t _dropped_messages = 0;
+	std::uint64_t _disconnected_subscribers = 0;
+public:
+	static constexpr bool HANDS_OVER_CONNECTIONS = true;
+
+	broadcast_protocol(std::size_t max_queue_bytes, slow_subscriber_policy policy) :
+		_max_queue_bytes(max_queue_bytes), _policy(policy)
+	{
+
+	}
+
+	template <class core_type>
+	void on_accept(core_type&, server_connection* conn) { this->_subscribers.add(conn); }
+
+	// Stores the messages of one receive once and queues the same buffer on every subscriber
+	template <class core_type>
+	void on_receive(core_type& core, server_connection* conn, std::size_t received)
+	{
+		auto shared = shared_buffer::create(conn->_fill + received + 1);
+
+		conn->consume_lines(received, [&](const char* msg, std::size_t msg_len)
+		{
+			core.persist(conn, msg, msg_len);
+
+			shared->append(msg, msg_len);
+			shared->append("\n", 1);
+		});
+
+		if (shared->_length != 0)
+		{
+			for (auto subscriber : this->_subscribers)
+			{
+				auto sub = static_cast<server_connection*>(subscriber);
+
+				if (sub->_out.queued_bytes() > this->_max_queue_bytes)
+				{
+					if (this->_policy == slow_subscriber_policy::DROP)
+					{
+						this->_dropped_messages++;
+						continue;
+					}
+
+					// closing here would reorder the list under the loop, on_iteration does it
+					if (std::find(this->_slow_subscribers.begin(), this->_slow_subscribers.end(), sub) == this->_slow_subscribers.end())
+					{
+						this->_disconnected_subscribers++;
+						this->_slow_subscribers.push_back(sub);
+					}
+
+					continue;
+				}
+
+				sub->_out.append_shared(shared);
+				core.mark_dirty(sub);
+			}
+		}
+
+		shared->release();
+	}
+
+	template <class core_type>
+	void on_close(core_type&, server_connection* conn)
+	{
+		this->_subscribers.remove(conn);
+
+		auto slow = std::find(this->_slow_subscribers.begin(), this->_slow_subscribers.end(), conn);
+
+		if (slow != this->_slow_subscribers.end())
+			this->_slow_subscribers.erase(slow);
+	}
+
+	template <class core_type>
+	void on_iteration(core_type& core)
+	{
+		// begin_close calls on_close, which takes the connection out of the list
+		while (!this->_slow_subscribers.empty())
+		{
+			auto conn = this->_slow_subscribers.back();
+			core.log("slow subscriber %d disconnected\n", conn->_sock);
+			core.begin_close(conn);
+		}
+	}
+
+	void dump_stats(int worker) const
+	{
+		if (this->_dropped_messages != 0 || this->_disconnected_subscribers != 0)
+			std::printf("worker %d: slow subscribers missed %llu batches, %llu disconnected\n", worker,
+				(unsigned long long)this->_dropped_messages, (unsigned long long)this->_disconnected_subscribers);
+	}
+};
+
+// SUB <topic>, UNSUB <topic>, PUB <topic> <payload>, REPLAY <sequence>. REPLAY sends the
+// persisted PUB lines of every topic from a log sequence on, see server_core::replay.
+class pubsub_protocol
+{
+	topic_index _topics;
+	std::vector<server_connection*> _slow_subscribers;
+	std::size_t _max_queue_bytes;
+	slow_subscriber_policy _policy;
+
+	template <class core_type>
+	void handle_line(core_type& core, server_connection* conn, std::string_view line)
+	{
+		auto args = line;
+		auto cmd = next_token(args);
+
+		auto reply = [&](const char* status, std::string_view topic)
+		{
+			conn->_out.append(status, std::strlen(status));
+			conn->_out.append(topic.data(), topic.size());
+			conn->_out.append("\n", 1);
+			core.mark_dirty(conn);
+		};
+
+		if (cmd == "PUB")
+		{
+			auto topic = next_token(args);
+
+			if (!topic.empty())
+			{
+				core.persist(conn, line.data(), line.size());
+				this->_topics.publish(topic, args);
+				return;
+			}
+		}
+		else if (cmd == "SUB" && !args.empty())
+		{
+			this->_topics.subscribe(conn, args);
+			reply("SUBSCRIBED ", args);
+			return;
+		}
+		else if (cmd == "UNSUB" && !args.empty())
+		{
+			reply(this->_topics.unsubscribe(conn, args) ? "UNSUBSCRIBED " : "NOT_SUBSCRIBED ", args);
+			return;
+		}
+		else if (cmd == "REPLAY")
+		{
+			std::uint64_t from_sequence;
+			auto [end, ec] = std::from_chars(args.data(), args.data() + args.size(), from_sequence);
+
+			if (ec == std::errc() && end == args.data() + args.size() && core.replay(conn, from_sequence))
+				return;
+		}
+
+		reply("ERROR ", cmd);
+	}
+public:
+	// subscriptions live in this process, so subscribers are drained instead
+	static constexpr bool HANDS_OVER_CONNECTIONS = false;
+
+	pubsub_protocol(std::size_t max_queue_bytes, slow_subscriber_policy policy) :
+		_max_queue_bytes(max_queue_bytes), _policy(policy)
+	{
+
+	}
+
+	template <class core_type>
+	void on_accept(core_type&, server_connection*) {}
+
+	template <class core_type>
+	void on_receive(core_type& core, server_connection* conn, std::size_t received)
+	{
+		conn->consume_lines(received, [&](const char* msg, std::size_t msg_len)
+		{
+			this->handle_line(core, conn, std::string_view(msg, msg_len));
+		});
+	}
+
+	template <class core_type>
+	void on_close(core_type&, server_connection* conn) { this->_topics.unsubscribe_all(conn); }
+
+	// Fans out the batches published during the iteration and drops the subscribers that fell behind
+	template <class core_type>
+	void on_iteration(core_type& core)
+	{
+		this->_topics.deliver(this->_max_queue_bytes, this->_policy, this->_slow_subscribers, [&core](server_connection* conn)
+		{
+			core.mark_dirty(conn);
+		});
+
+		for (auto conn : this->_slow_subscribers)
+		{
+			core.log("slow subscriber %d disconnected\n", conn->_sock);
+			core.begin_close(conn);
+		}
+
+		this->_slow_subscribers.clear();
+	}
+
+	void dump_stats(int worker) const
+	{
+		if (this->_topics._dropped_messages != 0 || this->_topics._disconnected_subscribers != 0)
+			std::printf("worker %d: slow subscribers missed %llu batches, %llu disconnected\n", worker,
+				(unsigned long long)this->_topics._dropped_messages, (unsigned long long)this->_topics._disconnected_subscribers);
+	}
+};
+
+// SET <key> <value>, GET <key>, DEL <key>; only SET and DEL reach the sink
+class kv_protocol
+{
+	kv_store _kv;
+
+	template <class core_type>
+	void handle_line(core_type& core, server_connection* conn, std::string_view line)
+	{
+		auto args = line;
+		auto cmd = next_token(args);
+
+		auto reply = [&](std::string_view status, std::string_view value = {})
+		{
+			conn->_out.append(status.data(), status.size());
+			conn->_out.append(value.data(), value.size());
+			conn->_out.append("\n", 1);
+			core.mark_dirty(conn);
+		};
+
+		if (cmd == "GET" && !args.empty())
+		{
+			std::string_view value;
+
+			if (this->_kv.get(args, value))
+				reply("VALUE ", value);
+			else
+				reply("NOT_FOUND");
+		}
+		else if (cmd == "SET" && !args.empty())
+		{
+			auto key = next_token(args);
+			this->_kv.set(key, args);
+			core.persist(conn, line.data(), line.size());
+			reply("OK");
+		}
+		else if (cmd == "DEL" && !args.empty())
+		{
+			if (this->_kv.del(args))
+			{
+				core.persist(conn, line.data(), line.size());
+				reply("DELETED");
+			}
+			else
+				reply("NOT_FOUND");
+		}
+		else
+			reply("ERROR ", cmd);
+	}
+public:
+	static constexpr bool HANDS_OVER_CONNECTIONS = true;
+
+	kv_protocol(kv_store&& kv) : _kv(std::move(kv)) {}
+
+	template <class core_type>
+	void on_accept(core_type&, server_connection*) {}
+
+	template <class core_type>
+	void on_receive(core_type& core, server_connection* conn, std::size_t received)
+	{
+		conn->consume_lines(received, [&](const char* msg, std::size_t msg_len)
+		{
+			this->handle_line(core, conn, std::string_view(msg, msg_len));
+		});
+	}
+
+	template <class core_type>
+	void on_close(core_type&, server_connection*) {}
+
+	template <class core_type>
+	void on_iteration(core_type&) {}
+
+	void dump_stats(int) const {}
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "connection.hpp"
+#include "timer_wheel.hpp"
+#include "log_segment.hpp"
+
+enum server_command : std::uint32_t
+{
+	ACCEPT = uring_sock_udata_t::FIRST_USER_COMMAND,
+	RECEIVE,
+	SEND_TIMEOUT,
+	SEND,
+	ACK_TIMEOUT,
+	STATS_TIMER,
+	UPGRADE_ACCEPT,
+	SHUTDOWN_SIGNAL,
+	SHUTDOWN_DEADLINE,
+	DEADLINE_TICK,
+	REPLAY_SPLICE_IN,
+	REPLAY_SPLICE_OUT,
+	BLOB_SPLICE,
+	BLOB_STORE,
+	BLOB_COMMIT,
+	MAX_SIZE_CMD
+};
+
+// Position of a subscription inside the owning topic's dense subscriber array
+struct topic_ref
+{
+	std::uint32_t _topic;
+	std::uint32_t _topic_slot;
+};
+
+// Stream mode connection: pipeline ack state and pub/sub subscriptions on top of the runtime slot
+struct server_connection : connection_t
+{
+	enum ack_state
+	{
+		ACK_IDLE,
+		ACK_WAIT_TIMEOUT
+	};
+
+	// identifies the connection in the message log
+	std::uint64_t _id;
+	std::uint64_t _seq;
+	std::uint64_t _acked_seq;
+	ack_state _ack_state;
+	// receive stopped for a hot upgrade or shutdown, the connection is handed over or closed once it is quiet
+	bool _parked;
+
+	std::vector<topic_ref> _topics;
+
+	// deadline checks, in ticks of the core's timer wheel: last receive or send completion, and
+	// when the buffered partial line started
+	wheel_entry _deadline;
+	std::uint64_t _last_activity;
+	std::uint64_t _partial_since;
+
+	// log replay: the parts of the log still to send and the pipe they pass through on their way
+	// from the segment files to the socket. _replay_in_pipe is what sits in the pipe, frame
+	// header included, _replay_frame_left what the current frame still has to take from the file.
+	bool _replaying;
+	bool _replay_inflight;
+	int _replay_pipe[2];
+	std::vector<log_span> _replay_spans;
+	std::size_t _replay_in_pipe;
+	std::size_t _replay_frame_left;
+
+	// blob ingest: the announced payload passes through the pipe part by part on its way from the
+	// socket into its record in the log. _blob_left bytes are still to come from the connection,
+	// _blob_in_pipe wait in the pipe and _blob_stored are in the log.
+	int _blob_pipe[2];
+	std::size_t _blob_length;
+	std::size_t _blob_left;
+	std::size_t _blob_in_pipe;
+	std::size_t _blob_stored;
+	spliced_record _blob_record;
+
+	uring_sock_udata_t _ack_timeout_op;
+	uring_sock_udata_t _splice_in_op;
+	uring_sock_udata_t _splice_out_op;
+	uring_sock_udata_t _blob_op;
+	uring_sock_udata_t _blob_store_op;
+	uring_sock_udata_t _blob_commit_op;
+
+	server_connection(int sock, char* recv_buffer = nullptr, int recv_fixed_index = -1) :
+		connection_t(sock, recv_buffer, recv_fixed_index),
+		_ack_timeout_op(server_command::ACK_TIMEOUT, sock, nullptr, {}, this),
+		_splice_in_op(server_command::REPLAY_SPLICE_IN, sock, nullptr, {}, this),
+		_splice_out_op(server_command::REPLAY_SPLICE_OUT, sock, nullptr, {}, this),
+		_blob_op(server_command::BLOB_SPLICE, sock, nullptr, {}, this),
+		_blob_store_op(server_command::BLOB_STORE, sock, nullptr, {}, this),
+		_blob_commit_op(server_command::BLOB_COMMIT, sock, nullptr, {}, this)
+	{
+		this->_deadline._owner = this;
+		this->reset(sock);
+	}
+
+	void reset(int sock)
+	{
+		connection_t::reset(sock);
+		this->_id = 0;
+		this->_seq = this->_acked_seq = 0;
+		this->_ack_state = ACK_IDLE;
+		this->_parked = false;
+		this->_topics.clear();
+		this->_last_activity = this->_partial_since = 0;
+		this->_replaying = this->_replay_inflight = false;
+		this->_replay_pipe[0] = this->_replay_pipe[1] = -1;
+		this->_replay_spans.clear();
+		this->_replay_in_pipe = this->_replay_frame_left = 0;
+		this->_blob_pipe[0] = this->_blob_pipe[1] = -1;
+		this->_blob_length = this->_blob_left = this->_blob_in_pipe = this->_blob_stored = 0;
+		this->_blob_record = {};
+		this->_ack_timeout_op._sock = this->_splice_in_op._sock = this->_splice_out_op._sock = sock;
+		this->_blob_op._sock = this->_blob_store_op._sock = this->_blob_commit_op._sock = sock;
+	}
+};
@@ -0,0 +1,1297 @@
+#pragma once
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <netinet/in.h>
+
+#include "util.hpp"
+#include "timer.hpp"
+#include "tsc.hpp"
+#include "stats.hpp"
+#include "buffer_pool.hpp"
+#include "connection.hpp"
+#include "handover.hpp"
+#include "shutdown.hpp"
+#include "timer_wheel.hpp"
+#include "ring_loop.hpp"
+#include "server_connection.hpp"
+
+// Prints the loop counters every interval. The op is embedded, so the completion must not free it
+class stats_timer
+{
+	__kernel_timespec _interval;
+	uring_sock_udata_t _op;
+public:
+	stats_timer(std::uint32_t interval_ms) :
+		_interval(to_kts(std::chrono::milliseconds(interval_ms))),
+		_op(server_command::STATS_TIMER, -1)
+	{
+
+	}
+
+	void arm(ring_loop& loop)
+	{
+		auto sqe = loop.acquire_sqe();
+		io_uring_prep_timeout(sqe, &this->_interval, 0, 0);
+		io_uring_sqe_set_data(sqe, &this->_op);
+	}
+
+	void fire(ring_loop& loop)
+	{
+		loop.stats().dump(stdout);
+		std::fflush(stdout);
+		this->arm(loop);
+	}
+};
+
+// Per-connection deadlines in milliseconds, 0 turns one off. idle bounds the time without a receive
+// or a completed send, read how long a partial line waits for its end, write how long one sendmsg
+// may stay in flight.
+struct connection_deadlines
+{
+	std::uint32_t _idle_ms = 0;
+	std::uint32_t _read_ms = 0;
+	std::uint32_t _write_ms = 0;
+
+	inline bool enabled() const { return this->_idle_ms != 0 || this->_read_ms != 0 || this->_write_ms != 0; }
+};
+
+// Stream server on ring_loop: accept, line framed receive, batched replies and deferred close.
+// What differs between builds comes in as policies, so a null logger or sink leaves nothing
+// behind on the receive path:
+//   logger   - operator()(fmt, ...) for connection events, trace(fmt, ...) per receive
+//   sink     - write_record(connection, data, length), begin_spliced(connection, length, record), flush(), sync(),
+//              open_replay(from_sequence, spans)
+//   protocol - on_accept(core, conn), on_receive(core, conn, received), on_close(core, conn), on_iteration(core),
+//              dump_stats(worker), HANDS_OVER_CONNECTIONS
+//   reply    - immediate(), delay()
+template <class logger, class sink, class protocol, class reply>
+class server_core
+{
+	ring_loop& _loop;
+	int _listen_sock;
+
+	logger _log;
+	sink _sink;
+	protocol _protocol;
+	reply _reply;
+
+	// receive buffers of every slot, registered with the ring as fixed buffers in run()
+	buffer_pool _recv_buffers;
+	connection_table<server_connection> _connections;
+	std::vector<connection_t*> _dirty_connections;
+
+	// submit to completion of every sendmsg, stamped from the op's _timestamp
+	latency_histogram _send_latency;
+
+	// accepted connections, and how many of them had their packets handled on this worker's CPU
+	int _worker = 0;
+	int _cpu = -1;
+	std::uint64_t _accepted = 0;
+	std::uint64_t _accepted_on_cpu = 0;
+	// ids of the log records, unique across workers: worker << 48 | connections opened so far
+	std::uint64_t _connection_ids = 0;
+
+	// connections whose fd is still open, the loop stops at zero once an upgrade or shutdown quiesced
+	std::size_t _open = 0;
+
+	// Hot upgrade: a new process connecting to _upgrade_sock takes over the listener and, with
+	// _upgrade_connections, every connection that goes quiet after its receive is cancelled
+	int _upgrade_sock = -1;
+	int _upgrade_channel = -1;
+	bool _upgrade_connections = false;
+	bool _quiescing = false;
+	bool _quiesced = false;
+	std::size_t _quiesce_receiving = 0;
+	std::vector<handover_fd> _adopted;
+
+	// Shutdown: quiesces without a handover channel, the deadline stops the loop at the latest
+	shutdown_signal* _shutdown = nullptr;
+	bool _shutdown_primary = false;
+	bool _shutting_down = false;
+	__kernel_timespec _shutdown_deadline{};
+	signalfd_siginfo _siginfo{};
+
+	sockaddr_in _client_addr{};
+	socklen_t _client_addr_length = sizeof(sockaddr_in);
+	uring_sock_udata_t _accept_op;
+	uring_sock_udata_t _upgrade_accept_op;
+	uring_sock_udata_t _shutdown_op;
+	uring_sock_udata_t _shutdown_deadline_op;
+
+	// Deadlines are checked lazily: activity only stamps the wheel's current tick, an expiring entry
+	// re-checks its connection and either reaps it or schedules the next deadline due. A partial line
+	// or send that starts right after a check is seen at the next one, so read and write deadlines
+	// fire within twice their length. The wheel is driven by a single ring timeout per tick.
+	connection_deadlines _deadlines;
+	std::uint64_t _idle_ticks = 0;
+	std::uint64_t _read_ticks = 0;
+	std::uint64_t _write_ticks = 0;
+	std::uint64_t _tick_ns = 0;
+	__kernel_timespec _tick_interval{};
+	tsc_clock::time_point _wheel_start;
+	timer_wheel _wheel;
+	std::uint64_t _reaped_idle = 0;
+	std::uint64_t _reaped_read = 0;
+	std::uint64_t _reaped_write = 0;
+	uring_sock_udata_t _wheel_op;
+
+	// Log replays: a frame is at most REPLAY_FRAME bytes of records so every replaying connection
+	// gets its turn on the ring's workers, the pipe holds a whole frame with its header
+	static constexpr std::size_t REPLAY_FRAME = 64 * 1024;
+	static constexpr int REPLAY_PIPE_SIZE = 256 * 1024;
+	std::uint64_t _replays = 0;
+	std::uint64_t _replayed_bytes = 0;
+
+	// Blobs pass through a pipe of this size a part at a time, whatever their length
+	static constexpr int BLOB_PIPE_SIZE = 256 * 1024;
+	std::uint64_t _blobs = 0;
+	std::uint64_t _blob_bytes = 0;
+
+	void next_accept()
+	{
+		this->_client_addr_length = sizeof(this->_client_addr);
+
+		auto sqe = this->_loop.acquire_sqe();
+		io_uring_prep_accept(sqe, this->_listen_sock, (sockaddr*)&this->_client_addr, &this->_client_addr_length, 0);
+		io_uring_sqe_set_data(sqe, &this->_accept_op);
+	}
+
+	void next_upgrade_accept()
+	{
+		auto sqe = this->_loop.acquire_sqe();
+		io_uring_prep_accept(sqe, this->_upgrade_sock, nullptr, nullptr, SOCK_CLOEXEC);
+		io_uring_sqe_set_data(sqe, &this->_upgrade_accept_op);
+	}
+
+	void next_receive(server_connection* conn)
+	{
+		auto sqe = this->_loop.acquire_sqe();
+		auto buffer = conn->_recv_buffer + conn->_fill;
+		auto length = connection_t::RECEIVE_BUFFER_SIZE - conn->_fill;
+
+		// a read on a stream socket behaves like recv without flags, so registered buffers can use READ_FIXED
+		if (conn->_recv_fixed_index >= 0)
+			io_uring_prep_read_fixed(sqe, conn->_sock, buffer, length, 0, conn->_recv_fixed_index);
+		else
+			io_uring_prep_recv(sqe, conn->_sock, buffer, length, 0);
+
+		io_uring_sqe_set_data(sqe, &conn->_recv_op);
+		conn->_ops_inflight++;
+	}
+
+	void next_ack_timeout(server_connection* conn)
+	{
+		auto sqe = this->_loop.acquire_sqe();
+		io_uring_prep_timeout(sqe, this->_reply.delay(), 0, 0);
+		io_uring_sqe_set_data(sqe, &conn->_ack_timeout_op);
+		conn->_ack_state = server_connection::ACK_WAIT_TIMEOUT;
+		conn->_ops_inflight++;
+	}
+
+	void next_send(connection_t* conn)
+	{
+		int flags = 0;
+		auto msg = conn->_out.next_msg(flags);
+
+		if (msg == nullptr)
+			return;
+
+		auto sqe = this->_loop.acquire_sqe();
+		io_uring_prep_sendmsg(sqe, conn->_sock, msg, flags);
+		io_uring_sqe_set_data(sqe, &conn->_send_op);
+		conn->_send_op._timestamp = tsc_clock::now();
+		conn->_send_inflight = true;
+		conn->_ops_inflight++;
+	}
+
+	void cancel_op(uring_sock_udata_t* op)
+	{
+		auto sqe = this->_loop.acquire_sqe();
+		io_uring_prep_cancel(sqe, op, 0);
+		io_uring_sqe_set_data(sqe, nullptr);
+	}
+
+	void release_connection(server_connection* conn)
+	{
+		if (conn->_ops_inflight != 0)
+			return;
+
+		if (conn->_replaying)
+			this->end_replay(conn);
+
+		close_blob(conn);
+		conn->_out.reset();
+		close(conn->_sock);
+		conn->_sock = -1;
+		this->_open--;
+		this->_log("disconnected client\n");
+	}
+
+	server_connection* open_connection(int sock)
+	{
+		auto conn = this->_connections.acquire(sock);
+		conn->_id = ((std::uint64_t)this->_worker << 48) | ++this->_connection_ids;
+		this->_open++;
+		this->_protocol.on_accept(*this, conn);
+
+		if (this->_deadlines.enabled())
+		{
+			conn->_last_activity = this->_wheel.now();
+			this->check_deadlines(conn);
+		}
+
+		// accepted after the upgrade began, it never receives here and goes with the others
+		if (this->_quiescing)
+			conn->_parked = true;
+		else
+			this->next_receive(conn);
+
+		return conn;
+	}
+
+	// Stops accepting and receiving for an upgrade or a shutdown; whatever is in flight completes normally
+	void quiesce()
+	{
+		this->_quiescing = true;
+		this->cancel_op(&this->_accept_op);
+
+		this->_connections.for_each([&](server_connection* conn)
+		{
+			if (conn->_closing)
+				return;
+
+			conn->_parked = true;
+
+			// a blob's splice from the socket stands in for the receive, while a store into the log
+			// is in flight the blob goes on up to the point where it would read the socket again
+			if (conn->_blob_length != 0 && !blob_reading(conn))
+				return;
+
+			this->cancel_op(conn->_blob_length != 0 ? &conn->_blob_op : &conn->_recv_op);
+			this->_quiesce_receiving++;
+		});
+	}
+
+	void begin_upgrade(int channel)
+	{
+		// a shutdown already quiesces, the new process gets nothing and starts on its own
+		if (this->_quiescing)
+		{
+			close(channel);
+			return;
+		}
+
+		this->_upgrade_channel = channel;
+		this->quiesce();
+		this->_log("upgrade started, waiting for %zu receives\n", this->_quiesce_receiving);
+	}
+
+	static bool quiet(const server_connection* conn)
+	{
+		return conn->_ops_inflight == 0 && conn->_out.empty() && !conn->_dirty && !conn->_replaying;
+	}
+
+	// Runs after the iteration's flush. Once no receive is left and every parked connection has sent
+	// its last reply, an upgrade hands over the listener and the connections without a partial line,
+	// the rest is closed. The loop stops when the last fd of this process is closed.
+	void step_quiesce()
+	{
+		if (!this->_quiesced)
+		{
+			if (this->_quiesce_receiving != 0)
+				return;
+
+			bool busy = false;
+
+			this->_connections.for_each([&](server_connection* conn)
+			{
+				if (!conn->_closing && !quiet(conn))
+					busy = true;
+			});
+
+			if (busy || !this->finish_quiesce())
+				return;
+		}
+
+		if (this->_open == 0)
+			this->_loop.stop();
+	}
+
+	bool finish_quiesce()
+	{
+		std::vector<server_connection*> handed;
+		std::vector<server_connection*> drained;
+		std::vector<handover_fd> fds;
+		auto upgrade = this->_upgrade_channel >= 0;
+
+		this->_connections.for_each([&](server_connection* conn)
+		{
+			if (conn->_closing)
+				return;
+
+			if (upgrade && this->_upgrade_connections && protocol::HANDS_OVER_CONNECTIONS && conn->_fill == 0 && conn->_blob_length == 0)
+			{
+				handed.push_back(conn);
+				fds.push_back({ conn->_sock, conn->_seq });
+			}
+			else
+				drained.push_back(conn);
+		});
+
+		// the new process may replay the log and appends to it, so the log has to be complete, its
+		// writes in flight included, before it hears back
+		this->_sink.sync();
+
+		if (upgrade)
+		{
+			auto sent = handover_send(this->_upgrade_channel, { this->_listen_sock }, fds);
+			close(this->_upgrade_channel);
+			this->_upgrade_channel = -1;
+
+			if (!sent && !this->_shutting_down)
+			{
+				this->resume_after_upgrade();
+				return false;
+			}
+
+			if (!sent)
+			{
+				drained.insert(drained.end(), handed.begin(), handed.end());
+				handed.clear();
+			}
+		}
+
+		// the new process holds its own references now, so no shutdown here
+		for (auto conn : handed)
+		{
+			this->_wheel.cancel(&conn->_deadline);
+			conn->_closing = true;
+			this->_protocol.on_close(*this, conn);
+			conn->_out.reset();
+			close(conn->_sock);
+			conn->_sock = -1;
+			this->_open--;
+		}
+
+		for (auto conn : drained)
+		{
+			this->begin_close(conn);
+			this->release_connection(conn);
+		}
+
+		if (this->_upgrade_sock >= 0)
+		{
+			close(this->_upgrade_sock);
+			this->_upgrade_sock = -1;
+		}
+
+		this->_quiesced = true;
+
+		if (upgrade)
+			this->_log("upgrade: handed over %zu connections, closed %zu\n", handed.size(), drained.size());
+		else
+			this->_log("shutdown: closed %zu connections\n", drained.size());
+
+		return true;
+	}
+
+	// The new process did not take everything, it closes what it got, so this one keeps serving
+	void resume_after_upgrade()
+	{
+		this->_log("upgrade: handover failed, resuming\n");
+
+		this->_quiescing = false;
+
+		this->_connections.for_each([&](server_connection* conn)
+		{
+			if (!conn->_parked)
+				return;
+
+			conn->_parked = false;
+
+			if (!conn->_closing)
+				this->next_input(conn);
+		});
+
+		this->next_accept();
+		this->next_upgrade_accept();
+	}
+
+	// The signal reading ring waits on the signalfd, the others on the eventfd it raises
+	void next_shutdown_wait()
+	{
+		auto sqe = this->_loop.acquire_sqe();
+
+		if (this->_shutdown_primary)
+			io_uring_prep_read(sqe, this->_shutdown->signal_fd(), &this->_siginfo, sizeof(this->_siginfo), 0);
+		else
+			io_uring_prep_poll_add(sqe, this->_shutdown->event_fd(), POLLIN);
+
+		io_uring_sqe_set_data(sqe, &this->_shutdown_op);
+	}
+
+	void begin_shutdown()
+	{
+		this->_shutting_down = true;
+
+		auto sqe = this->_loop.acquire_sqe();
+		io_uring_prep_timeout(sqe, &this->_shutdown_deadline, 0, 0);
+		io_uring_sqe_set_data(sqe, &this->_shutdown_deadline_op);
+
+		// an upgrade in progress closes whatever it cannot hand over, or the deadline ends it
+		if (!this->_quiescing)
+			this->quiesce();
+	}
+
+	void dump_stats()
+	{
+		this->_send_latency.dump(stdout, "send");
+		std::printf("worker %d: accepted %llu, on its cpu %llu\n", this->_worker,
+			(unsigned long long)this->_accepted, (unsigned long long)this->_accepted_on_cpu);
+
+		if (this->_replays != 0)
+			std::printf("worker %d: replays %llu, %llu bytes spliced\n", this->_worker,
+				(unsigned long long)this->_replays, (unsigned long long)this->_replayed_bytes);
+
+		if (this->_blobs != 0)
+			std::printf("worker %d: blobs %llu, %llu bytes spliced\n", this->_worker,
+				(unsigned long long)this->_blobs, (unsigned long long)this->_blob_bytes);
+
+		if (this->_deadlines.enabled())
+			std::printf("worker %d: reaped idle %llu, read %llu, write %llu\n", this->_worker,
+				(unsigned long long)this->_reaped_idle, (unsigned long long)this->_reaped_read, (unsigned long long)this->_reaped_write);
+
+		this->_protocol.dump_stats(this->_worker);
+	}
+
+	void next_wheel_tick()
+	{
+		auto sqe = this->_loop.acquire_sqe();
+		io_uring_prep_timeout(sqe, &this->_tick_interval, 0, 0);
+		io_uring_sqe_set_data(sqe, &this->_wheel_op);
+	}
+
+	// Catches the wheel up with the clock, a late timeout advances it by several ticks at once
+	void advance_wheel()
+	{
+		auto target = elapsed_ns(this->_wheel_start) / this->_tick_ns;
+
+		while (this->_wheel.now() < target)
+		{
+			this->_wheel.advance([&](wheel_entry* entry)
+			{
+				this->check_deadlines(static_cast<server_connection*>(entry->_owner));
+			});
+		}
+	}
+
+	void check_deadlines(server_connection* conn)
+	{
+		if (conn->_closing)
+			return;
+
+		auto now = this->_wheel.now();
+		std::uint64_t due = UINT64_MAX;
+
+		if (this->_write_ticks != 0 && conn->_send_inflight)
+		{
+			auto in_flight = elapsed_ns(conn->_send_op._timestamp) / this->_tick_ns;
+
+			if (in_flight >= this->_write_ticks)
+			{
+				this->reap(conn, this->_reaped_write, "write");
+				return;
+			}
+
+			due = std::min(due, now + this->_write_ticks - in_flight);
+		}
+		else if (this->_write_ticks != 0)
+			due = std::min(due, now + this->_write_ticks);
+
+		if (this->_read_ticks != 0 && (conn->_fill != 0 || conn->_blob_length != 0))
+		{
+			if (now - conn->_partial_since >= this->_read_ticks)
+			{
+				this->reap(conn, this->_reaped_read, "read");
+				return;
+			}
+
+			due = std::min(due, conn->_partial_since + this->_read_ticks);
+		}
+		else if (this->_read_ticks != 0)
+			due = std::min(due, now + this->_read_ticks);
+
+		if (this->_idle_ticks != 0)
+		{
+			if (now - conn->_last_activity >= this->_idle_ticks)
+			{
+				this->reap(conn, this->_reaped_idle, "idle");
+				return;
+			}
+
+			due = std::min(due, conn->_last_activity + this->_idle_ticks);
+		}
+
+		this->_wheel.schedule(&conn->_deadline, due);
+	}
+
+	void reap(server_connection* conn, std::uint64_t& counter, const char* reason)
+	{
+		counter++;
+		this->_log("%s deadline, closing %d\n", reason, conn->_sock);
+
+		this->cancel_op(&conn->_recv_op);
+
+		if (conn->_send_inflight)
+			this->cancel_op(&conn->_send_op);
+
+		if (conn->_replay_inflight)
+		{
+			this->cancel_op(&conn->_splice_in_op);
+			this->cancel_op(&conn->_splice_out_op);
+		}
+
+		// stores into the log are left to complete
+		if (conn->_blob_length != 0 && blob_reading(conn))
+			this->cancel_op(&conn->_blob_op);
+
+		this->begin_close(conn);
+		this->release_connection(conn);
+	}
+
+	// Arms the receive side again: the blob in progress goes on, otherwise the next receive
+	void next_input(server_connection* conn)
+	{
+		if (conn->_blob_length != 0)
+			this->continue_blob(conn);
+		else if (!conn->_parked)
+			this->next_receive(conn);
+	}
+
+	// The pipe is empty and the blob still takes bytes from the connection, so its splice from the
+	// socket is the step in flight
+	static bool blob_reading(const server_connection* conn)
+	{
+		return conn->_blob_in_pipe == 0 && conn->_blob_left != 0;
+	}
+
+	// Takes the blob one step further, one step is in flight at a time: what waits in the pipe is
+	// spliced into the record, the empty pipe is filled from the receive buffer or the socket, and
+	// once the whole payload is stored the header is written over the placeholder. A parked
+	// connection stops short of the socket.
+	void continue_blob(server_connection* conn)
+	{
+		auto& record = conn->_blob_record;
+
+		if (blob_reading(conn) && conn->_fill != 0)
+		{
+			auto length = std::min(conn->_fill, conn->_blob_left);
+
+			// the empty pipe holds more than the receive buffer, the write cannot block
+			if (write(conn->_blob_pipe[1], conn->_recv_buffer, length) != (ssize_t)length)
+			{
+				this->begin_close(conn);
+				this->release_connection(conn);
+				return;
+			}
+
+			conn->_fill -= length;
+			std::memmove(conn->_recv_buffer, conn->_recv_buffer + length, conn->_fill);
+			conn->_blob_left -= length;
+			conn->_blob_in_pipe = length;
+		}
+
+		if (blob_reading(conn) && conn->_parked)
+			return;
+
+		auto sqe = this->_loop.acquire_sqe();
+
+		if (conn->_blob_in_pipe != 0)
+		{
+			auto at = record._header_at + sizeof(log_record_header) + conn->_blob_stored;
+			io_uring_prep_splice(sqe, conn->_blob_pipe[0], -1, record._fd, at, conn->_blob_in_pipe, 0);
+			io_uring_sqe_set_data(sqe, &conn->_blob_store_op);
+		}
+		else if (conn->_blob_left != 0)
+		{
+			auto length = std::min<std::size_t>(conn->_blob_left, BLOB_PIPE_SIZE);
+			io_uring_prep_splice(sqe, conn->_sock, -1, conn->_blob_pipe[1], -1, length, 0);
+			io_uring_sqe_set_data(sqe, &conn->_blob_op);
+		}
+		else
+		{
+			record.complete();
+			io_uring_prep_write(sqe, record._fd, &record._header, sizeof(record._header), record._header_at);
+			io_uring_sqe_set_data(sqe, &conn->_blob_commit_op);
+		}
+
+		conn->_ops_inflight++;
+	}
+
+	static void close_blob(server_connection* conn)
+	{
+		for (auto& fd : conn->_blob_pipe)
+		{
+			if (fd >= 0)
+				close(fd);
+
+			fd = -1;
+		}
+
+		conn->_blob_record.close();
+		conn->_blob_length = conn->_blob_left = conn->_blob_in_pipe = conn->_blob_stored = 0;
+	}
+
+	// The record is complete, header included, so the blob counts as received
+	void finish_blob(server_connection* conn)
+	{
+		this->_blobs++;
+		this->_blob_bytes += conn->_blob_length;
+		close_blob(conn);
+
+		conn->_seq++;
+		this->acknowledge(conn);
+	}
+
+	// Moves the pipe's content and the rest of the frame to the socket: a splice from the segment
+	// into the pipe linked to a splice from the pipe into the socket, the records never reach
+	// userspace
+	void next_replay_splice(server_connection* conn)
+	{
+		this->_loop.reserve_sqes(2);
+
+		if (conn->_replay_frame_left != 0)
+		{
+			auto& span = conn->_replay_spans.front();
+			auto sqe = this->_loop.acquire_sqe();
+			io_uring_prep_splice(sqe, span._fd, span._offset, conn->_replay_pipe[1], -1, conn->_replay_frame_left, 0);
+			io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+			io_uring_sqe_set_data(sqe, &conn->_splice_in_op);
+			conn->_ops_inflight++;
+		}
+
+		auto sqe = this->_loop.acquire_sqe();
+		io_uring_prep_splice(sqe, conn->_replay_pipe[0], -1, conn->_sock, -1, conn->_replay_in_pipe + conn->_replay_frame_left, 0);
+		io_uring_sqe_set_data(sqe, &conn->_splice_out_op);
+		conn->_ops_inflight++;
+		conn->_replay_inflight = true;
+	}
+
+	// Runs whenever neither a frame nor a send is in flight: finishes the current frame, lets the
+	// replies queued meanwhile go first unless they just went, or starts the next frame
+	void continue_replay(server_connection* conn, bool after_send)
+	{
+		if (conn->_replay_in_pipe != 0 || conn->_replay_frame_left != 0)
+		{
+			this->next_replay_splice(conn);
+			return;
+		}
+
+		if (!after_send && conn->_out.pending())
+		{
+			this->next_send(conn);
+			return;
+		}
+
+		if (conn->_replay_spans.empty())
+		{
+			this->end_replay(conn);
+
+			static const char end[] = "REPLAY END\n";
+			conn->_out.append(end, sizeof(end) - 1);
+			this->mark_dirty(conn);
+			return;
+		}
+
+		// the pipe is empty between frames, so the header write cannot block
+		conn->_replay_frame_left = std::min<std::uint64_t>(conn->_replay_spans.front()._length, REPLAY_FRAME);
+
+		to_ch_string<32> header("REPLAY %zu\n", conn->_replay_frame_left);
+		auto header_length = std::strlen(header);
+
+		if (write(conn->_replay_pipe[1], header, header_length) != (ssize_t)header_length)
+		{
+			this->begin_close(conn);
+			this->release_connection(conn);
+			return;
+		}
+
+		conn->_replay_in_pipe = header_length;
+		this->next_replay_splice(conn);
+	}
+
+	// Only once no splice is in flight, so the pipe's descriptors cannot be reused under one
+	void end_replay(server_connection* conn)
+	{
+		for (auto& span : conn->_replay_spans)
+			close(span._fd);
+
+		conn->_replay_spans.clear();
+		close(conn->_replay_pipe[0]);
+		close(conn->_replay_pipe[1]);
+		conn->_replay_pipe[0] = conn->_replay_pipe[1] = -1;
+		conn->_replay_in_pipe = conn->_replay_frame_left = 0;
+		conn->_replaying = false;
+	}
+
+	void count_accept(int sock)
+	{
+		this->_accepted++;
+
+		if (this->_cpu < 0)
+			return;
+
+		int cpu = -1;
+		socklen_t cpu_length = sizeof(cpu);
+
+		if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_length) == 0 && cpu == this->_cpu)
+			this->_accepted_on_cpu++;
+	}
+
+	// One cumulative ack covers every message received up to _seq
+	void queue_ack(server_connection* conn)
+	{
+		to_ch_string<32> ack("ACCEPTED %llu\n", (unsigned long long)conn->_seq);
+		conn->_out.append(ack, std::strlen(ack));
+		conn->_acked_seq = conn->_seq;
+		this->mark_dirty(conn);
+	}
+
+	// Runs once per loop iteration so every reply queued during it leaves in a single sendmsg
+	void flush_connections()
+	{
+		for (auto conn : this->_dirty_connections)
+		{
+			conn->_dirty = false;
+
+			// a replaying connection sends its replies between frames
+			if (conn->_closing || conn->_send_inflight || static_cast<server_connection*>(conn)->_replay_inflight)
+				continue;
+
+			this->next_send(conn);
+		}
+
+		this->_dirty_connections.clear();
+	}
+
+	void on_cqe(io_uring_cqe* cqe, uring_sock_udata_t* ud)
+	{
+		switch (ud->_ucmd)
+		{
+			case server_command::ACCEPT:
+			{
+				if (!this->_quiescing)
+					this->next_accept();
+
+				if (cqe->res >= 0)
+				{
+					this->count_accept(cqe->res);
+					this->open_connection(cqe->res);
+					this->_log("new client\n");
+				}
+
+				break;
+			}
+			case server_command::SHUTDOWN_SIGNAL:
+			{
+				if (cqe->res < 0)
+				{
+					this->next_shutdown_wait();
+					break;
+				}
+
+				if (this->_shutdown_primary)
+				{
+					this->_log("shutdown on signal %u\n", this->_siginfo.ssi_signo);
+					this->_shutdown->raise();
+				}
+
+				this->begin_shutdown();
+				break;
+			}
+			case server_command::SHUTDOWN_DEADLINE:
+			{
+				this->_log("shutdown deadline, %zu connections still open\n", this->_open);
+				this->_loop.stop();
+				break;
+			}
+			case server_command::DEADLINE_TICK:
+			{
+				this->advance_wheel();
+				this->next_wheel_tick();
+				break;
+			}
+			case server_command::UPGRADE_ACCEPT:
+			{
+				if (cqe->res < 0)
+					this->next_upgrade_accept();
+				else
+					this->begin_upgrade(cqe->res);
+
+				break;
+			}
+			case uring_sock_udata_t::CONNECTION_RECEIVE:
+			{
+				auto conn = static_cast<server_connection*>(ud->_conn);
+				conn->_ops_inflight--;
+
+				// a parked connection keeps whatever its last receive brought, but is not re-armed
+				if (conn->_parked)
+				{
+					this->_quiesce_receiving--;
+
+					if (cqe->res == -ECANCELED && !conn->_closing)
+						break;
+				}
+
+				if (cqe->res <= 0 || conn->_closing)
+				{
+					this->begin_close(conn);
+					this->release_connection(conn);
+					break;
+				}
+
+				auto partial = conn->_fill != 0;
+				this->process(conn, cqe->res);
+
+				if (conn->_closing)
+				{
+					this->release_connection(conn);
+					break;
+				}
+
+				conn->_last_activity = this->_wheel.now();
+
+				if (!partial && (conn->_fill != 0 || conn->_blob_length != 0))
+					conn->_partial_since = conn->_last_activity;
+
+				this->next_input(conn);
+				break;
+			}
+			case server_command::BLOB_SPLICE:
+			{
+				auto conn = static_cast<server_connection*>(ud->_conn);
+				conn->_ops_inflight--;
+
+				if (conn->_parked)
+				{
+					this->_quiesce_receiving--;
+
+					if (cqe->res == -ECANCELED && !conn->_closing)
+						break;
+				}
+
+				if (cqe->res <= 0 || conn->_closing)
+				{
+					this->begin_close(conn);
+					this->release_connection(conn);
+					break;
+				}
+
+				conn->_blob_left -= cqe->res;
+				conn->_blob_in_pipe = cqe->res;
+				conn->_last_activity = this->_wheel.now();
+				this->continue_blob(conn);
+				break;
+			}
+			case server_command::BLOB_STORE:
+			{
+				auto conn = static_cast<server_connection*>(ud->_conn);
+				conn->_ops_inflight--;
+
+				if (cqe->res <= 0 || conn->_closing || !conn->_blob_record.add_stored(conn->_blob_stored, cqe->res))
+				{
+					this->begin_close(conn);
+					this->release_connection(conn);
+					break;
+				}
+
+				conn->_blob_stored += cqe->res;
+				conn->_blob_in_pipe -= cqe->res;
+				this->continue_blob(conn);
+				break;
+			}
+			case server_command::BLOB_COMMIT:
+			{
+				auto conn = static_cast<server_connection*>(ud->_conn);
+				conn->_ops_inflight--;
+
+				if (cqe->res != (int)sizeof(log_record_header) || conn->_closing)
+				{
+					this->begin_close(conn);
+					this->release_connection(conn);
+					break;
+				}
+
+				this->finish_blob(conn);
+
+				// the lines behind the blob, they may announce the next one
+				this->_protocol.on_receive(*this, conn, 0);
+
+				if (conn->_closing)
+				{
+					this->release_connection(conn);
+					break;
+				}
+
+				if (conn->_fill != 0 || conn->_blob_length != 0)
+					conn->_partial_since = this->_wheel.now();
+
+				this->next_input(conn);
+				break;
+			}
+			case server_command::ACK_TIMEOUT:
+			{
+				auto conn = static_cast<server_connection*>(ud->_conn);
+				conn->_ops_inflight--;
+				conn->_ack_state = server_connection::ACK_IDLE;
+
+				if (conn->_closing)
+				{
+					this->release_connection(conn);
+					break;
+				}
+
+				this->queue_ack(conn);
+				break;
+			}
+			case uring_sock_udata_t::CONNECTION_SEND:
+			{
+				auto conn = static_cast<server_connection*>(ud->_conn);
+				conn->_ops_inflight--;
+				conn->_send_inflight = false;
+				this->_send_latency.record(elapsed_ns(ud->_timestamp));
+
+				if (conn->_closing || cqe->res <= 0)
+				{
+					this->begin_close(conn);
+					this->release_connection(conn);
+					break;
+				}
+
+				conn->_last_activity = this->_wheel.now();
+
+				if (conn->_out.complete(cqe->res))
+					this->next_send(conn);
+				else if (conn->_replaying)
+					this->continue_replay(conn, true);
+				else if (conn->_out.pending())
+					this->mark_dirty(conn);
+
+				break;
+			}
+			case server_command::REPLAY_SPLICE_IN:
+			{
+				auto conn = static_cast<server_connection*>(ud->_conn);
+				conn->_ops_inflight--;
+
+				if (conn->_closing)
+				{
+					this->release_connection(conn);
+					break;
+				}
+
+				// the frame header promised the bytes, a stream missing some cannot be resynced
+				if (cqe->res <= 0)
+				{
+					this->_log("replay read failed (%d), closing %d\n", cqe->res, conn->_sock);
+					this->begin_close(conn);
+					break;
+				}
+
+				auto& span = conn->_replay_spans.front();
+				span._offset += cqe->res;
+				span._length -= cqe->res;
+				conn->_replay_in_pipe += cqe->res;
+				conn->_replay_frame_left -= cqe->res;
+
+				if (span._length == 0)
+				{
+					close(span._fd);
+					conn->_replay_spans.erase(conn->_replay_spans.begin());
+				}
+
+				break;
+			}
+			case server_command::REPLAY_SPLICE_OUT:
+			{
+				auto conn = static_cast<server_connection*>(ud->_conn);
+				conn->_ops_inflight--;
+				conn->_replay_inflight = false;
+
+				// a short splice in cancels the linked splice out, the next one picks up the rest
+				if (conn->_closing || (cqe->res <= 0 && cqe->res != -ECANCELED))
+				{
+					this->begin_close(conn);
+					this->release_connection(conn);
+					break;
+				}
+
+				if (cqe->res > 0)
+				{
+					conn->_replay_in_pipe -= cqe->res;
+					this->_replayed_bytes += cqe->res;
+					conn->_last_activity = this->_wheel.now();
+				}
+
+				this->continue_replay(conn, false);
+				break;
+			}
+		}
+	}
+public:
+	server_core(ring_loop& loop, int listen_sock, logger log, sink persist, protocol proto, reply rep, buffer_pool_options pool_options = {}) :
+		_loop(loop),
+		_listen_sock(listen_sock),
+		_log(log),
+		_sink(std::move(persist)),
+		_protocol(std::move(proto)),
+		_reply(rep),
+		_recv_buffers(connection_t::RECEIVE_BUFFER_SIZE, 1024, pool_options),
+		_connections(&this->_recv_buffers),
+		_accept_op(server_command::ACCEPT, listen_sock),
+		_upgrade_accept_op(server_command::UPGRADE_ACCEPT, -1),
+		_shutdown_op(server_command::SHUTDOWN_SIGNAL, -1),
+		_shutdown_deadline_op(server_command::SHUTDOWN_DEADLINE, -1),
+		_wheel(512),
+		_wheel_op(server_command::DEADLINE_TICK, -1)
+	{
+
+	}
+
+	server_core(const server_core&) = delete;
+
+	template <class... args>
+	inline void log(const char* fmt, args... a) { this->_log(fmt, a...); }
+
+	// Labels the stats of a worker and enables counting accepts that arrived on its CPU
+	inline void set_worker(int worker, int cpu)
+	{
+		this->_worker = worker;
+		this->_cpu = cpu;
+	}
+
+	// Connections passed over by the previous process, run() resumes them before the first accept
+	inline void adopt(std::vector<handover_fd> connections) { this->_adopted = std::move(connections); }
+
+	// Takes the first connection on the handover channel upgrade_sock as the signal to upgrade
+	inline void enable_upgrade(int upgrade_sock, bool hand_over_connections)
+	{
+		this->_upgrade_sock = upgrade_sock;
+		this->_upgrade_connections = hand_over_connections;
+	}
+
+	// Drains on SIGTERM/SIGINT: the primary ring reads the signal and wakes the others, every
+	// ring then finishes its pending replies and closes its connections within deadline
+	inline void enable_shutdown(shutdown_signal* shutdown, bool primary, std::chrono::milliseconds deadline)
+	{
+		this->_shutdown = shutdown;
+		this->_shutdown_primary = primary;
+		this->_shutdown_deadline = to_kts(deadline);
+	}
+
+	// The wheel ticks at an eighth of the shortest deadline, between 10 ms and 1 s
+	void set_deadlines(connection_deadlines deadlines)
+	{
+		this->_deadlines = deadlines;
+
+		if (!deadlines.enabled())
+			return;
+
+		std::uint32_t shortest = UINT32_MAX;
+
+		for (auto ms : { deadlines._idle_ms, deadlines._read_ms, deadlines._write_ms })
+		{
+			if (ms != 0)
+				shortest = std::min(shortest, ms);
+		}
+
+		auto tick_ms = std::clamp<std::uint32_t>(shortest / 8, 10, 1000);
+		auto to_ticks = [tick_ms](std::uint32_t ms) -> std::uint64_t { return ms == 0 ? 0 : (ms + tick_ms - 1) / tick_ms; };
+
+		this->_tick_ns = (std::uint64_t)tick_ms * 1000000;
+		this->_tick_interval = to_kts(std::chrono::milliseconds(tick_ms));
+		this->_idle_ticks = to_ticks(deadlines._idle_ms);
+		this->_read_ticks = to_ticks(deadlines._read_ms);
+		this->_write_ticks = to_ticks(deadlines._write_ms);
+	}
+
+	inline void persist(const server_connection* conn, const char* data, std::size_t length) { this->_sink.write_record(conn->_id, data, length); }
+
+	void mark_dirty(connection_t* conn)
+	{
+		if (conn->_dirty)
+			return;
+
+		conn->_dirty = true;
+		this->_dirty_connections.push_back(conn);
+	}
+
+	// Acks everything received so far, right away or once the reply delay expires
+	void acknowledge(server_connection* conn)
+	{
+		if (conn->_seq == conn->_acked_seq)
+			return;
+
+		if (this->_reply.immediate())
+			this->queue_ack(conn);
+		else if (conn->_ack_state == server_connection::ACK_IDLE)
+			this->next_ack_timeout(conn);
+	}
+
+	// Stops new work on the connection, the fd is closed by the last completing op
+	void begin_close(server_connection* conn)
+	{
+		if (conn->_closing)
+			return;
+
+		conn->_closing = true;
+		this->_protocol.on_close(*this, conn);
+		this->_wheel.cancel(&conn->_deadline);
+
+		if (conn->_ack_state == server_connection::ACK_WAIT_TIMEOUT)
+			this->cancel_op(&conn->_ack_timeout_op);
+
+		shutdown(conn->_sock, SHUT_RDWR);
+	}
+
+	// Streams the log from from_sequence on back to the connection, as frames of "REPLAY <n>\n"
+	// followed by n bytes of records as they are stored, then "REPLAY END\n". The payloads of
+	// the frames together are the record stream, a record may continue in the next frame. Frames
+	// alternate with the connection's other replies, so live traffic keeps flowing during a long
+	// replay. The placeholders of blobs still arriving or never completed are part of the stream,
+	// readers step over them, see is_log_placeholder. False when the sink keeps no numbered log
+	// or the connection already replays.
+	bool replay(server_connection* conn, std::uint64_t from_sequence)
+	{
+		if (conn->_replaying || conn->_closing)
+			return false;
+
+		if (!this->_sink.open_replay(from_sequence, conn->_replay_spans))
+			return false;
+
+		if (pipe2(conn->_replay_pipe, O_CLOEXEC) != 0)
+		{
+			this->end_replay(conn);
+			return false;
+		}
+
+		fcntl(conn->_replay_pipe[1], F_SETPIPE_SZ, REPLAY_PIPE_SIZE);
+
+		conn->_replaying = true;
+		this->_replays++;
+
+		// otherwise the send completion starts it
+		if (!conn->_send_inflight)
+			this->continue_replay(conn, false);
+
+		return true;
+	}
+
+	// Takes the next length bytes of the connection as one message, moved from the socket into its
+	// record in the log through a pipe without being copied through userspace, see continue_blob
+	void expect_blob(server_connection* conn, std::size_t length)
+	{
+		if (length > UINT32_MAX
+			|| pipe2(conn->_blob_pipe, O_CLOEXEC) != 0
+			|| !this->_sink.begin_spliced(conn->_id, length, conn->_blob_record))
+		{
+			this->_log("blob of %zu bytes could not be started, closing %d\n", length, conn->_sock);
+			close_blob(conn);
+			this->begin_close(conn);
+			return;
+		}
+
+		// a splice from a socket takes a pipe slot per packet fragment rather than per page, a
+		// larger pipe moves more per step; without it the default size only takes more steps
+		fcntl(conn->_blob_pipe[1], F_SETPIPE_SZ, BLOB_PIPE_SIZE);
+
+		conn->_blob_length = conn->_blob_left = length;
+	}
+
+	// Protocol work for received bytes, kept apart from the completion so it runs without a ring
+	inline void process(server_connection* conn, std::size_t received)
+	{
+		this->_log.trace("received %zu bytes from %d\n", received, conn->_sock);
+		this->_protocol.on_receive(*this, conn, received);
+	}
+
+	void run(std::uint32_t stats_interval_ms)
+	{
+		stats_timer stats(stats_interval_ms);
+
+		if (auto ret = this->_loop.register_buffers(this->_recv_buffers); ret < 0)
+			this->_log("io_uring_register_buffers return %d, receiving into unregistered buffers\n", ret);
+
+		this->_log("receive buffers: %s%s\n", this->_recv_buffers.page_kind(), this->_recv_buffers.locked() ? ", locked" : "");
+
+		if (this->_deadlines.enabled())
+		{
+			this->_wheel_start = tsc_clock::now();
+			this->next_wheel_tick();
+		}
+
+		for (auto& adopted : this->_adopted)
+		{
+			auto conn = this->open_connection(adopted._fd);
+			conn->_seq = conn->_acked_seq = adopted._seq;
+		}
+
+		if (!this->_adopted.empty())
+			this->_log("adopted %zu connections\n", this->_adopted.size());
+
+		this->next_accept();
+
+		if (this->_upgrade_sock >= 0)
+			this->next_upgrade_accept();
+
+		if (this->_shutdown != nullptr)
+			this->next_shutdown_wait();
+
+		if (stats_interval_ms != 0)
+			stats.arm(this->_loop);
+
+		this->_loop.submit();
+
+		this->_loop.run([&](io_uring_cqe* cqe, uring_sock_udata_t* ud)
+			{
+				if (ud->_ucmd == server_command::STATS_TIMER)
+				{
+					this->dump_stats();
+					stats.fire(this->_loop);
+				}
+				else
+					this->on_cqe(cqe, ud);
+			},
+			[&]()
+			{
+				this->_protocol.on_iteration(*this);
+				this->flush_connections();
+				this->_sink.flush();
+
+				if (this->_quiescing)
+					this->step_quiesce();
+			});
+
+		this->_sink.flush();
+
+		if (!this->_sink.sync())
+			this->_log("log sync failed\n");
+
+		this->dump_stats();
+		this->_loop.stats().dump(stdout);
+		std::fflush(stdout);
+	}
+};
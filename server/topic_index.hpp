@@ -0,0 +1,238 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+
+#include "buffer_pool.hpp"
+#include "server_connection.hpp"
+
+enum class slow_subscriber_policy
+{
+	DROP,
+	DISCONNECT
+};
+
+// Topic -> subscribers routing for the pub/sub mode. The hash table only holds 8 byte
+// {hash, topic id} slots with linear probing, the topics themselves are dense arrays.
+// Subscriptions are linked both ways so either side can swap-remove in O(1).
+class topic_index
+{
+	struct subscriber_ref
+	{
+		server_connection* _conn;
+		std::uint32_t _conn_slot;
+	};
+
+	struct topic_t
+	{
+		std::string _name;
+		std::vector<subscriber_ref> _subscribers;
+		std::vector<char> _pending;
+		bool _dirty = false;
+	};
+
+	struct slot
+	{
+		std::uint32_t _hash;
+		std::uint32_t _topic_plus_one;
+	};
+
+	std::vector<slot> _slots = std::vector<slot>(1024);
+	std::vector<topic_t> _topics;
+	std::vector<std::uint32_t> _dirty_topics;
+
+	static auto hash(std::string_view name)
+	{
+		std::uint32_t h = 2166136261u;
+		for (auto c : name)
+			h = (h ^ (std::uint8_t)c) * 16777619u;
+		return h;
+	}
+
+	void grow()
+	{
+		std::vector<slot> slots(this->_slots.size() * 2);
+		auto mask = slots.size() - 1;
+
+		for (auto& s : this->_slots)
+		{
+			if (s._topic_plus_one == 0)
+				continue;
+
+			auto i = s._hash & mask;
+			while (slots[i]._topic_plus_one != 0)
+				i = (i + 1) & mask;
+
+			slots[i] = s;
+		}
+
+		this->_slots.swap(slots);
+	}
+
+	std::uint32_t find(std::string_view name, bool create)
+	{
+		auto h = hash(name);
+		auto mask = this->_slots.size() - 1;
+
+		for (auto i = h & mask;; i = (i + 1) & mask)
+		{
+			auto& s = this->_slots[i];
+
+			if (s._topic_plus_one == 0)
+			{
+				if (!create)
+					return UINT32_MAX;
+
+				s = { h, (std::uint32_t)this->_topics.size() + 1 };
+				this->_topics.emplace_back()._name = name;
+
+				auto id = (std::uint32_t)this->_topics.size() - 1;
+
+				if (this->_topics.size() * 2 > this->_slots.size())
+					this->grow();
+
+				return id;
+			}
+
+			if (s._hash == h && this->_topics[s._topic_plus_one - 1]._name == name)
+				return s._topic_plus_one - 1;
+		}
+	}
+
+	void remove_subscription(server_connection* conn, std::uint32_t conn_slot)
+	{
+		auto ref = conn->_topics[conn_slot];
+		auto& subs = this->_topics[ref._topic]._subscribers;
+
+		// the last entry of either array moves into the freed slot, unless it is the removed one
+		if (ref._topic_slot != subs.size() - 1)
+		{
+			auto moved = subs.back();
+			subs[ref._topic_slot] = moved;
+			moved._conn->_topics[moved._conn_slot]._topic_slot = ref._topic_slot;
+		}
+
+		subs.pop_back();
+
+		if (conn_slot != conn->_topics.size() - 1)
+		{
+			auto moved_ref = conn->_topics.back();
+			conn->_topics[conn_slot] = moved_ref;
+			this->_topics[moved_ref._topic]._subscribers[moved_ref._topic_slot]._conn_slot = conn_slot;
+		}
+
+		conn->_topics.pop_back();
+	}
+public:
+	std::uint64_t _dropped_messages = 0;
+	std::uint64_t _disconnected_subscribers = 0;
+
+	bool subscribe(server_connection* conn, std::string_view name)
+	{
+		auto id = this->find(name, true);
+
+		for (auto& ref : conn->_topics)
+		{
+			if (ref._topic == id)
+				return false;
+		}
+
+		auto& subs = this->_topics[id]._subscribers;
+		conn->_topics.push_back({ id, (std::uint32_t)subs.size() });
+		subs.push_back({ conn, (std::uint32_t)conn->_topics.size() - 1 });
+		return true;
+	}
+
+	bool unsubscribe(server_connection* conn, std::string_view name)
+	{
+		auto id = this->find(name, false);
+
+		for (std::uint32_t i = 0; i < conn->_topics.size(); i++)
+		{
+			if (conn->_topics[i]._topic != id)
+				continue;
+
+			this->remove_subscription(conn, i);
+			return true;
+		}
+
+		return false;
+	}
+
+	void unsubscribe_all(server_connection* conn)
+	{
+		while (!conn->_topics.empty())
+			this->remove_subscription(conn, conn->_topics.size() - 1);
+	}
+
+	// Deliveries are accumulated per topic and fanned out once per loop iteration
+	void publish(std::string_view name, std::string_view payload)
+	{
+		auto id = this->find(name, false);
+
+		if (id == UINT32_MAX || this->_topics[id]._subscribers.empty())
+			return;
+
+		auto& topic = this->_topics[id];
+		auto& pending = topic._pending;
+		pending.insert(pending.end(), { 'M', 'S', 'G', ' ' });
+		pending.insert(pending.end(), name.begin(), name.end());
+		pending.push_back(' ');
+		pending.insert(pending.end(), payload.begin(), payload.end());
+		pending.push_back('\n');
+
+		if (!topic._dirty)
+		{
+			topic._dirty = true;
+			this->_dirty_topics.push_back(id);
+		}
+	}
+
+	// Queues each dirty topic's batch on its subscribers as one shared buffer. Subscribers whose
+	// queue is over max_queue_bytes either miss the batch or are returned in slow for disconnecting.
+	template <class fn>
+	void deliver(std::size_t max_queue_bytes, slow_subscriber_policy policy, std::vector<server_connection*>& slow, fn&& on_queued)
+	{
+		for (auto id : this->_dirty_topics)
+		{
+			auto& topic = this->_topics[id];
+			topic._dirty = false;
+
+			auto shared = shared_buffer::create(topic._pending.size());
+			shared->append(topic._pending.data(), topic._pending.size());
+			topic._pending.clear();
+
+			for (auto& sub : topic._subscribers)
+			{
+				auto conn = sub._conn;
+
+				if (conn->_out.queued_bytes() > max_queue_bytes)
+				{
+					if (policy == slow_subscriber_policy::DROP)
+					{
+						this->_dropped_messages++;
+						continue;
+					}
+
+					if (std::find(slow.begin(), slow.end(), conn) == slow.end())
+					{
+						this->_disconnected_subscribers++;
+						slow.push_back(conn);
+					}
+
+					continue;
+				}
+
+				conn->_out.append_shared(shared);
+				on_queued(conn);
+			}
+
+			shared->release();
+		}
+
+		this->_dirty_topics.clear();
+	}
+};
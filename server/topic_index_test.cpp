@@ -0,0 +1,142 @@
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "topic_index.hpp"
+
+// Subscribe, unsubscribe and close against topic_index, checked by publishing to every topic and
+// comparing who the batch is delivered to with a plain set of subscriptions. Exits non-zero on
+// the first mismatch.
+//   server_topic_index_test [steps=20000]
+
+static constexpr int CONNECTIONS = 8;
+static constexpr int TOPICS = 5;
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what)
+{
+	if (!ok)
+	{
+		std::printf("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+static std::string topic_name(int topic)
+{
+	std::string name("T");
+	name += std::to_string(topic);
+	return name;
+}
+
+// Connections the batch published to the topic reaches
+static std::set<server_connection*> receivers(topic_index& index, int topic)
+{
+	std::set<server_connection*> got;
+	std::vector<server_connection*> slow;
+
+	index.publish(topic_name(topic), "payload");
+	index.deliver(SIZE_MAX, slow_subscriber_policy::DROP, slow, [&](server_connection* conn)
+	{
+		got.insert(conn);
+		conn->_out.reset();
+	});
+
+	return got;
+}
+
+static bool matches(topic_index& index, std::vector<std::set<server_connection*>>& model)
+{
+	for (int topic = 0; topic < TOPICS; topic++)
+	{
+		if (receivers(index, topic) != model[topic])
+			return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	auto steps = argc > 1 ? std::atoi(argv[1]) : 20000;
+
+	std::vector<std::unique_ptr<server_connection>> conns;
+
+	for (int i = 0; i < CONNECTIONS; i++)
+		conns.push_back(std::make_unique<server_connection>(100 + i));
+
+	// a connection that is the only subscriber leaves an empty topic behind
+	{
+		topic_index index;
+		std::vector<std::set<server_connection*>> model(TOPICS);
+
+		index.subscribe(conns[0].get(), topic_name(0));
+		expect(index.unsubscribe(conns[0].get(), topic_name(0)), "only subscriber unsubscribes");
+		expect(conns[0]->_topics.empty() && matches(index, model), "only subscriber is gone");
+	}
+
+	// A SUBs T0, B SUBs T1 then T0, A UNSUBs T0: B's T0 entry must keep its own slot
+	{
+		topic_index index;
+		std::vector<std::set<server_connection*>> model(TOPICS);
+		auto a = conns[0].get();
+		auto b = conns[1].get();
+
+		index.subscribe(a, topic_name(0));
+		index.subscribe(b, topic_name(1));
+		index.subscribe(b, topic_name(0));
+		index.unsubscribe(a, topic_name(0));
+		index.unsubscribe(b, topic_name(0));
+
+		model[1].insert(b);
+		expect(matches(index, model), "unsubscribing the most recent SUB keeps the others");
+
+		index.unsubscribe_all(b);
+		model[1].erase(b);
+		expect(b->_topics.empty() && matches(index, model), "close removes every subscription");
+	}
+
+	// random subscribes, unsubscribes and closes
+	{
+		topic_index index;
+		std::vector<std::set<server_connection*>> model(TOPICS);
+		std::srand(1);
+
+		for (int step = 0; step < steps && failures == 0; step++)
+		{
+			auto conn = conns[std::rand() % CONNECTIONS].get();
+			auto topic = std::rand() % TOPICS;
+			auto op = std::rand() % 10;
+
+			if (op < 5)
+			{
+				expect(index.subscribe(conn, topic_name(topic)) == model[topic].insert(conn).second, "subscribe result");
+			}
+			else if (op < 9)
+			{
+				expect(index.unsubscribe(conn, topic_name(topic)) == (model[topic].erase(conn) != 0), "unsubscribe result");
+			}
+			else
+			{
+				index.unsubscribe_all(conn);
+
+				for (auto& subs : model)
+					subs.erase(conn);
+			}
+
+			expect(matches(index, model), "deliveries follow the subscriptions");
+		}
+	}
+
+	for (auto& conn : conns)
+		conn->_topics.clear();
+
+	if (failures == 0)
+		std::printf("topic_index: ok\n");
+
+	return failures == 0 ? 0 : 1;
+}